@@ -7,23 +7,136 @@
 #define FUSE_USE_VERSION 26
 
 #include <fuse.h>
+#include <fuse_opt.h>
 #include <errno.h>
 #include <fcntl.h>
+#include <sys/mman.h>
+#include <stddef.h>
 
 #include <assert.h>
 
 #include "myfs.h"
 
 #define next_multiple_of(x, m) (((x) + ((m)-1)) & ~((m)-1))
-#define size_to_block(x) ((int)((x) / BLOCK_SIZE))
+#define size_to_block(x) ((uint32_t)((x) / BLOCK_SIZE))
+
+// Blocks resolved from the block map at a time by a read or write
+#define MAP_BATCH 64
+
+// Blocks the reaper deletes at a time
+#define REAP_BATCH 1024
+
+// Blocks the data file is grown by at a time, so that it is laid out in large pieces
+#define DATA_GROW_BLOCKS 4096
+
+// How much of the data file is mapped for reads, the file grows into it
+#define DATA_MAP_SIZE ((size_t) 1 << 40)
+
+// Percentage of live blocks under which a full segment of the log is cleaned
+#define CLEAN_THRESHOLD_DEFAULT 50
+
+// What the version nibble of a key is replaced with to send its block to the log
+#define LOG_KEY_MARK 0xe0
+
+// Seconds and bytes a transaction may gather before it is committed
+#define COMMIT_INTERVAL_DEFAULT 5
+#define COMMIT_BYTES_DEFAULT (64 << 20)
+
+/*
+  UnQLite keeps a record in its bucket page when the page has room for the
+  cell header, the key and the data, and spills the data into a chain of
+  overflow pages when it doesn't. A block record is BLOCK_SIZE bytes of data
+  besides the page header (12 bytes), cell header (26 bytes) and key, so the
+  store's page size is made large enough to take it whole. The page size
+  is fixed when the store is created (-o page_size), a store which exists
+  keeps its own.
+ */
+#define BLOCK_RECORD_SIZE (12 + 26 + KEY_SIZE + BLOCK_SIZE)
+#define PAGE_SIZE_MIN 512
+#define PAGE_SIZE_MAX 65536
+
+// Where a store's header keeps its page size, after the signature, magic number, creation time and sector size
+#define STORE_PAGE_SIZE_OFFSET (7 + 4 + 4 + 4)
 
 // This is the pointer to the database we will use to store all our files
 unqlite *pDb;
 uuid_t zero_uuid;
+uuid_t superblock_uuid = {0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff, 0xff};
 static indirect_block_t empty_indirect_block = {0};
 
-myfs_hashtable_t *hashtable = NULL;
-myfs_node_t *root = NULL;
+// Keys of blocks of the data file, and of the chunks of its bitmap. Neither can be a random uuid.
+uuid_t data_file_uuid = {0xfe, 0xfe, 0xfe, 0xfe, 0xfe, 0xfe, 0xfe, 0xfe};
+uuid_t alloc_uuid = {0xfd, 0xfd, 0xfd, 0xfd, 0xfd, 0xfd, 0xfd, 0xfd};
+
+// Key of the table of the log's segments
+uuid_t segments_uuid = {0xfc, 0xfc, 0xfc, 0xfc, 0xfc, 0xfc, 0xfc, 0xfc};
+
+// Key of the record of removed files whose blocks are yet to be reclaimed
+uuid_t orphans_uuid = {0xfb, 0xfb, 0xfb, 0xfb, 0xfb, 0xfb, 0xfb, 0xfb};
+
+myfs_shards_t *cache = NULL;
+myfs_shards_t *itable = NULL;
+
+size_t cache_size = CACHE_DEFAULT_SIZE;
+size_t inode_cache_size = INODE_CACHE_DEFAULT_SIZE;
+myfs_cache_policy_t cache_policy = CACHE_DEFAULT_POLICY;
+uint32_t default_layout = LAYOUT_EXTENTS;
+unsigned int dirty_ratio = DIRTY_RATIO_DEFAULT;
+unsigned int dirty_age = DIRTY_AGE_DEFAULT;
+unsigned int commit_interval = COMMIT_INTERVAL_DEFAULT;
+size_t commit_bytes = COMMIT_BYTES_DEFAULT;
+size_t page_size = 0;
+unsigned int clean_threshold = CLEAN_THRESHOLD_DEFAULT;
+
+// When the open transaction began, and how much has been written in it
+time_t transaction_start;
+size_t transaction_bytes = 0;
+
+myfs_dcache_t *dcache = NULL;
+
+myfs_handles_t *handles = NULL;
+
+// Blocks of removed files which are yet to be deleted, and whether the store has a record of them
+myfs_reaper_t reaper = {0};
+pthread_mutex_t reaper_lock = PTHREAD_MUTEX_INITIALIZER;
+bool orphans_stored = false;
+
+// The data file, its size in blocks, and which of its blocks are in use
+int data_fd = -1;
+uint64_t data_file_blocks = 0;
+myfs_alloc_t allocator = {0};
+pthread_mutex_t alloc_lock = PTHREAD_MUTEX_INITIALIZER;
+
+// The data file mapped for reads (-o mmap), and how many blocks were read from it
+bool mmap_reads = false;
+const char *data_map = NULL;
+unsigned long data_map_reads = 0;
+
+// The log file and its segments
+int log_fd = -1;
+myfs_log_t segment_log = {0};
+pthread_mutex_t log_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/*
+  Locking. Operations may run on several threads at once. Every operation
+  holds fs_lock: read, write, truncate, readdir, getattr, open, flush and
+  release share it, while the rest (which change the namespace or an fcb) and
+  a commit hold it alone. Opening and releasing a file change the set of open
+  handles under the handles' own lock, and truncate resizes a file through
+  its handle. An open file's handle is its inode lock (see myfs.h),
+  which read shares and write holds alone, so reads and writes of different
+  files run side by side. Below those the caches, the dentry cache, the slabs
+  and the reaper each have a lock of their own, taken last and held briefly.
+  UnQLite does its own locking once it is put into multi-thread mode.
+ */
+pthread_rwlock_t fs_lock = PTHREAD_RWLOCK_INITIALIZER;
+
+// Reaps and commits in the background, see background_run
+pthread_t background;
+bool background_started = false;
+bool background_stop = false;
+pthread_mutex_t background_lock = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t background_wake = PTHREAD_COND_INITIALIZER;
 
 myfcb cached_root_fcb = {0};
 
@@ -43,1043 +156,3551 @@ void print_fcb(myfcb *inode)
 
 
 
-int db_put_block(uuid_t key, void *data, size_t size)
+/*
+  Write-back policy. Dirty blocks are written back, oldest first, once they
+  make up more than dirty_ratio percent of the cache (-o dirty_ratio) or have
+  been dirty for dirty_age seconds (-o dirty_age). This runs whenever a block
+  is dirtied, so a burst of writes is spread out rather than all landing on
+  the next flush.
+ */
+void cache_balance_dirty(myfs_cache_t *cache)
 {
+  time_t now = time(0);
 
-  int rc = 0;
+  while (cache->dirty.dirty_next != &(cache->dirty)) {
 
-  if (uuid_is_null(key))
-    return unqlite_kv_store(pDb, key, KEY_SIZE, data, size);
-  
+    myfs_node_t *oldest = cache->dirty.dirty_next;
 
-  myfs_node_t * cached_data = myfs_hashtable_get(hashtable, key); 
-  
-  if (cached_data) {
+    if (cache->dirty_bytes * 100 <= (size_t) dirty_ratio * cache->capacity
+	&& now - oldest->dirtied < dirty_age)
+      break;
 
-    // Write data to cached data
-    memcpy(cached_data->data, data, size);
+    cache_write_back(cache, oldest);
+  }
+}
 
-    // Move found cached data to top of queue
-    myfs_queue_rem(cached_data);
-    myfs_queue_top(root, cached_data);
-    
-  } else {
+/*
+  Data file. Block n of it is keyed by derive_key(data_file_uuid, n + 1),
+  and such keys are read and written there with pread and pwrite rather
+  than in the store. Everything else, fcbs, directories and extent lists,
+  stays in the store.
+ */
+static bool is_data_key(uuid_t key)
+{
+  return memcmp(key, data_file_uuid, KEY_SIZE / 2) == 0;
+}
+
+static uint64_t data_block(uuid_t key)
+{
+  uint64_t n = 0;
+
+  for (int i = KEY_SIZE / 2; i < KEY_SIZE; i++)
+    n = (n << 8) | key[i];
 
-    myfs_node_t * to_be_cached = myfs_mk_node(key, data, size);
+  return n - 1;
+}
 
-    bool evict = (hashtable->s >= CACHE_EVICT_SIZE);
+static int data_write(uuid_t key, void *data, size_t size)
+{
+  if (pwrite(data_fd, data, size, (off_t) data_block(key) * BLOCK_SIZE) != (ssize_t) size)
+    return UNQLITE_IOERR;
 
-    if (evict) {
+  return UNQLITE_OK;
+}
 
-      myfs_node_t *to_be_evicted = root->prev;
+static int data_read(uuid_t key, void *data, unqlite_int64 *size)
+{
+  ssize_t got = pread(data_fd, data, *size, (off_t) data_block(key) * BLOCK_SIZE);
 
-      unqlite_kv_store(pDb, to_be_evicted->key, KEY_SIZE, to_be_evicted->data, to_be_evicted->size);
+  if (got < 0)
+    return UNQLITE_IOERR;
 
-      cache_evict(hashtable, root, to_be_evicted);
+  // Past the end of the file is a block which was never written
+  memset((char *) data + got, 0, *size - got);
 
-    }
+  return UNQLITE_OK;
+}
 
-    myfs_queue_top(root, to_be_cached);
-    myfs_hashtable_put(hashtable, to_be_cached);
-    
+/*
+  Makes the data file at least the given number of blocks long, growing it
+  DATA_GROW_BLOCKS at a time. Returns -ENOSPC, leaving the file as it was,
+  if it can't grow. The caller holds alloc_lock.
+ */
+static int data_reserve(uint64_t blocks)
+{
+  if (blocks <= data_file_blocks)
+    return 0;
+
+  uint64_t grown = next_multiple_of(blocks, DATA_GROW_BLOCKS);
+
+  // Where space can't be set aside the file is only extended, every block
+  // handed out must lie within it for the mapping to be read
+  if (posix_fallocate(data_fd, (off_t) data_file_blocks * BLOCK_SIZE, (off_t) (grown - data_file_blocks) * BLOCK_SIZE) != 0
+      && ftruncate(data_fd, (off_t) grown * BLOCK_SIZE) != 0) {
+
+    write_log("data_reserve: can't grow the data file to %lu blocks: %s\n", grown, strerror(errno));
+    return -ENOSPC;
   }
 
-  return rc;
+  __atomic_store_n(&data_file_blocks, grown, __ATOMIC_RELEASE);
+
+  return 0;
 }
 
-int db_get_block(uuid_t key, void *data, unqlite_int64 size)
+/*
+  Data file mapping. With -o mmap the data file is mapped read only, and
+  blocks of flat files are read by copying them straight out of the
+  mapping into fuse's buffer instead of through the block cache. The
+  kernel's page cache keeps them, and evicts them, instead. pwrite goes
+  through the same page cache, so the mapping sees every block written
+  back. A window of DATA_MAP_SIZE is mapped, which the file grows into.
+ */
+static void data_map_open()
 {
+  void *map = mmap(NULL, DATA_MAP_SIZE, PROT_READ, MAP_SHARED | MAP_NORESERVE, data_fd, 0);
 
-  int rc = 0;
+  if (map == MAP_FAILED) {
+    printf("init_fs: can't map the data file, reading it with pread\n");
+    return;
+  }
 
-  if (uuid_is_null(key))
-    return unqlite_kv_fetch(pDb, key, KEY_SIZE, data, &size);
+  // Flat files are laid out in runs, so read ahead along them
+  madvise(map, DATA_MAP_SIZE, MADV_SEQUENTIAL);
 
-  myfs_node_t * cached_data = myfs_hashtable_get(hashtable, key); 
-  
-  if (cached_data) {
+  data_map = map;
+}
 
-    memcpy(data, cached_data->data, size);
+/*
+  Where a block is in the mapping, or NULL if it isn't a block of the data
+  file or the data file isn't mapped that far
+ */
+static const char *data_map_block(uuid_t key)
+{
+  if (!data_map || !is_data_key(key))
+    return NULL;
 
-    myfs_queue_rem(cached_data);
-    myfs_queue_top(root, cached_data);
-    
-  } else {
+  uint64_t n = data_block(key);
 
-    unqlite_kv_fetch(pDb, key, KEY_SIZE, data, &size);
+  if (n >= DATA_MAP_SIZE / BLOCK_SIZE || n >= __atomic_load_n(&data_file_blocks, __ATOMIC_ACQUIRE))
+    return NULL;
 
-    myfs_node_t * to_be_cached = myfs_mk_node(key, data, size);
+  return data_map + n * BLOCK_SIZE;
+}
 
-    bool evict = (hashtable->s >= CACHE_EVICT_SIZE);
+/*
+  Asks the kernel to read in the runs of the data file a read is about to
+  copy from, rather than fault them in one page at a time
+ */
+static void data_map_advise(uuid_t *uuids, int count)
+{
+  uintptr_t page = sysconf(_SC_PAGESIZE);
 
-    if (evict) {
+  for (int i = 0; i < count; ) {
 
-      myfs_node_t *to_be_evicted = root->prev;
-      
-      unqlite_kv_store(pDb, to_be_evicted->key, KEY_SIZE, to_be_evicted->data, to_be_evicted->size);
+    const char *start = data_map_block(uuids[i]);
+    int n = 1;
 
-      cache_evict(hashtable, root, to_be_evicted);
+    if (!start) {
+      i++;
+      continue;
+    }
 
-    } 
+    while (i + n < count && data_map_block(uuids[i + n]) == start + (size_t) n * BLOCK_SIZE)
+      n++;
 
-    myfs_queue_top(root, to_be_cached);
-    myfs_hashtable_put(hashtable, to_be_cached);
-    
-  }
+    uintptr_t from = (uintptr_t) start & ~(page - 1);
 
-  return rc;
+    madvise((void *) from, (uintptr_t) start + (size_t) n * BLOCK_SIZE - from, MADV_WILLNEED);
+
+    i += n;
+  }
 }
 
-int db_put(uuid_t key, void *data, size_t size)
+/*
+  Log. Blocks of log files are keyed by derive_key of their file's
+  file_data_id with LOG_KEY_MARK in place of the version nibble, which a
+  random uuid never has. The block goes to the log, and the store keeps
+  where it went under its key. log_lock covers the segments and the
+  records of where blocks are.
+ */
+static bool is_log_key(uuid_t key)
 {
-  return unqlite_kv_store(pDb, key, KEY_SIZE, data, size);
+  return (key[6] & 0xf0) == LOG_KEY_MARK;
 }
 
-int db_get(uuid_t key, void *data, unqlite_int64 size)
+static off_t slot_offset(uint32_t segment, uint32_t slot)
 {
-  return unqlite_kv_fetch(pDb, key, KEY_SIZE, data, &size);
+  return segment * SEGMENT_SIZE + (off_t) slot * BLOCK_SIZE;
 }
 
-
-int db_rem(uuid_t key)
+static off_t summary_offset(uint32_t segment)
 {
-  unqlite_kv_delete(pDb, key, KEY_SIZE);
+  return slot_offset(segment, SEGMENT_BLOCKS);
 }
 
-void print_uuid(uuid_t uuid)
+static bool log_locate(uuid_t key, myfs_log_loc_t *loc)
 {
+  unqlite_int64 size = sizeof(myfs_log_loc_t);
 
-  char str[64];
-  uuid_unparse_lower(uuid, str);
-  printf("uuid %s\n", str);
+  return unqlite_kv_fetch(pDb, key, KEY_SIZE, loc, &size) == UNQLITE_OK;
 }
 
-bool split_path(char **p, char **s)
+static int log_write_summary()
 {
-  bool f = false;
-  
-  (*p)++;
-  (*s) = (*p);
-  while(**p != '/' && **p != '\0')
-    (*p)++;
-
-  if (**p == '\0')
-    f = true;
+  if (pwrite(log_fd, segment_log.summary, sizeof(segment_log.summary), summary_offset(segment_log.head)) != sizeof(segment_log.summary))
+    return UNQLITE_IOERR;
 
-  **p = '\0';
-
-  return f;
+  return UNQLITE_OK;
 }
 
-void ascend_path(char *p)
+/*
+  Appends a block at the head of the log and points its key at it, the
+  copy it replaces is dead. Where that copy is comes from old (segment
+  NO_SEGMENT if there is none), or is looked up if old is NULL. Where the
+  block went is left in loc. The caller holds log_lock.
+ */
+static int log_append(uuid_t key, void *data, size_t size, myfs_log_loc_t *old, myfs_log_loc_t *loc)
 {
-  char * s = p;
-  
-  p = (strlen(p) - 1) + p;
- 
-  while(*p != '/')
-    p--;
+  if (!segment_log.count || segment_log.segments[segment_log.head].used == SEGMENT_BLOCKS) {
 
-  *p = '\0';
+    if (segment_log.count && log_write_summary() != UNQLITE_OK)
+      return UNQLITE_IOERR;
 
-  if (s == p) {
-    *p++ = '/';
-    *p++ = '\0';
+    myfs_log_next_head(&segment_log);
   }
-}
 
-/* Takes a directory inode and returns the given filename's dirent (filename -> uuid)
- */
-bool search_file(const char* name, myfcb *directory_inode, dirent_t *dirent)
-{
-  bool retval = false;
-  
-  if (!directory_inode->file_data_id)
-    return retval;
+  myfs_segment_t *head = &(segment_log.segments[segment_log.head]);
+  myfs_log_loc_t at = { segment_log.head, head->used }, found;
 
-  if (!directory_inode->size)
-    return retval;
+  if (pwrite(log_fd, data, size, slot_offset(at.segment, at.slot)) != (ssize_t) size)
+    return UNQLITE_IOERR;
 
-  dirent_t * dirents = calloc(directory_inode->size, sizeof(dirent_t));
+  uuid_copy(segment_log.summary[at.slot], key);
 
-  db_get(directory_inode->file_data_id, dirents, directory_inode->size * sizeof(dirent_t));
-  
-  for (int i = 0; i < directory_inode->size; i++) {
-    if (strcmp(dirents[i].name, name) == 0) {
-      *dirent = dirents[i];
-      retval = true;
-      break;
-    }
-  }
+  head->used++;
+  head->live++;
 
-  free(dirents);
+  if (!old)
+    old = log_locate(key, &found) ? &found : NULL;
+  else if (old->segment == NO_SEGMENT)
+    old = NULL;
 
-  return retval;
-}
+  if (old)
+    segment_log.segments[old->segment].live--;
 
+  *loc = at;
 
+  segment_log.dirty = true;
+  segment_log.stats.appended++;
 
+  __atomic_add_fetch(&transaction_bytes, sizeof(myfs_log_loc_t), __ATOMIC_RELAXED);
 
-int app(uuid_t uuid, void *item, size_t size)
-{
-  return unqlite_kv_append(pDb, uuid, KEY_SIZE, item, size);
+  return unqlite_kv_store(pDb, key, KEY_SIZE, &at, sizeof(myfs_log_loc_t));
 }
 
-int get_root_inode()
+static int log_write(uuid_t key, void *data, size_t size, myfs_log_loc_t *old, myfs_log_loc_t *loc)
 {
-  return db_get(ROOT_OBJECT_KEY, &cached_root_fcb, sizeof(myfcb));
-}
+  pthread_mutex_lock(&log_lock);
+  int rc = log_append(key, data, size, old, loc);
+  pthread_mutex_unlock(&log_lock);
 
-int set_root_inode()
-{
-  return db_put(ROOT_OBJECT_KEY, &cached_root_fcb, sizeof(myfcb));
+  return rc;
 }
 
 /*
-  Appends a directory entry into a directory
+  Reads a block from the log, leaving where it is in loc, segment
+  NO_SEGMENT if it was never written
  */
-void add_dirent(uuid_t parent_uuid, myfcb* directory, dirent_t dirent)
+static int log_read(uuid_t key, void *data, unqlite_int64 *size, myfs_log_loc_t *loc)
 {
-  directory->size++;
-  app(directory->file_data_id, &dirent, sizeof(dirent_t));
+  pthread_mutex_lock(&log_lock);
+  bool found = log_locate(key, loc);
+  pthread_mutex_unlock(&log_lock);
+
+  // A block which was never written is a hole
+  if (!found) {
+    loc->segment = NO_SEGMENT;
+    return UNQLITE_NOTFOUND;
+  }
+
+  // The slot can't be reused before the next commit, which can't start while this runs
+  ssize_t got = pread(log_fd, data, *size, slot_offset(loc->segment, loc->slot));
+
+  if (got < 0)
+    return UNQLITE_IOERR;
+
+  memset((char *) data + got, 0, *size - got);
+
+  return UNQLITE_OK;
 }
 
-dirent_t mk_dirent(char *fname, uuid_t uuid)
+/*
+  Forgets where a block is, leaving its slot dead for the cleaner
+ */
+static void log_forget(uuid_t key)
 {
-  dirent_t d = {0};
-  strcpy(d.name, fname);
-  uuid_copy(d.uuid, uuid);
-  return d;
+  myfs_log_loc_t loc;
+
+  pthread_mutex_lock(&log_lock);
+
+  if (log_locate(key, &loc)) {
+
+    segment_log.segments[loc.segment].live--;
+    segment_log.dirty = true;
+
+    unqlite_kv_delete(pDb, key, KEY_SIZE);
+  }
+
+  pthread_mutex_unlock(&log_lock);
 }
 
-bool descend(char *name, myfcb *current_directory, uuid_t parent_uuid)
+/*
+  Cleans the full segment with the fewest live blocks, if they are under
+  clean_threshold percent of it (-o clean_threshold), and says whether there
+  was one. The live blocks, those whose key still points at their slot, are
+  appended at the head one at a time, so that writers are never held up for
+  more than a block, and a cached copy of a block is told where it went.
+  The segment is reused once the clean is committed.
+ */
+static bool log_clean()
 {
-  dirent_t dirent = {0};
+  pthread_mutex_lock(&log_lock);
+  uint32_t victim = myfs_log_victim(&segment_log, clean_threshold);
+  pthread_mutex_unlock(&log_lock);
 
-  if (search_file(name, current_directory, &dirent)) {
+  if (victim == NO_SEGMENT)
+    return false;
 
-    memset(current_directory, 0, sizeof(myfcb));
+  uuid_t *summary = malloc(SUMMARY_BLOCKS * BLOCK_SIZE);
+  block_t block;
 
-    int rc = db_get(dirent.uuid, current_directory, sizeof(myfcb));
+  bool failed = pread(log_fd, summary, SUMMARY_BLOCKS * BLOCK_SIZE, summary_offset(victim)) != SUMMARY_BLOCKS * BLOCK_SIZE;
 
-    assert(rc == UNQLITE_OK);
+  for (uint32_t slot = 0; !failed && slot < SEGMENT_BLOCKS; slot++) {
 
-    uuid_copy(parent_uuid, dirent.uuid);
-    
-    return true;
-  }
+    myfs_log_loc_t loc;
 
-  return false;
-}
+    if (!is_log_key(summary[slot]))
+      continue;
 
+    // Taken ahead of log_lock, as a write back takes them
+    myfs_cache_t *shard = myfs_shard(cache, summary[slot]);
 
-bool traverse(const char *path, uuid_t fcb_uuid, myfcb *current_directory)
-{
+    pthread_rwlock_wrlock(&(shard->lock));
+    pthread_mutex_lock(&log_lock);
 
-  memset(current_directory, 0, sizeof(myfcb));
-  
-  *current_directory = cached_root_fcb;
+    if (log_locate(summary[slot], &loc) && loc.segment == victim && loc.slot == slot) {
 
-  uuid_copy(fcb_uuid, zero_uuid);
-  
-  char copy[strlen(path) + 1]; strcpy(copy, path);
-  
-  char *p = copy;
-  char *s = NULL;
+      failed = pread(log_fd, &block, BLOCK_SIZE, slot_offset(victim, slot)) != BLOCK_SIZE
+	|| log_append(summary[slot], &block, BLOCK_SIZE, &loc, &loc) != UNQLITE_OK;
 
-  bool finished = strcmp(path, "/") == 0;
+      myfs_node_t *cached = myfs_hashtable_get(shard->hashtable, summary[slot]);
+
+      if (cached && !failed) {
+	cached->located = true;
+	cached->loc = loc;
+      }
 
-  while(!finished) {
+      segment_log.stats.relocated++;
+    }
 
-    finished = split_path(&p, &s);
+    pthread_mutex_unlock(&log_lock);
+    pthread_rwlock_unlock(&(shard->lock));
+  }
 
-    if (!descend(s, current_directory, fcb_uuid))
-      return false;
+  free(summary);
 
+  if (failed) {
+    write_log("log_clean: failed to clean segment %u\n", victim);
+    return false;
   }
 
+  pthread_mutex_lock(&log_lock);
+
+  // Nothing points into it any more, whatever its count says
+  segment_log.segments[victim].live = 0;
+  segment_log.cleaned[victim] = true;
+  segment_log.dirty = true;
+  segment_log.stats.cleaned++;
+
+  pthread_mutex_unlock(&log_lock);
+
   return true;
-  
 }
 
 /*
-  Creates an inode representing a file/directory and inserts it into a parents directory 
+  Makes the log durable ahead of the commit which points into it, and
+  writes the table of segments into the transaction. Segments being
+  cleaned are written as free, as they will be once it commits. Fails if
+  the log can't be written, and then the commit must not go ahead.
  */
-myfcb create_inode(uuid_t parent_uuid, myfcb *parent_directory, char *filename, bool is_directory, mode_t mode)
+static int log_sync()
 {
+  if (!segment_log.dirty)
+    return UNQLITE_OK;
 
-  myfcb fcb;
-  memset(&fcb, 0, sizeof(myfcb));
-
-  uuid_generate_random(fcb.file_data_id);
-
-  fcb.mode = mode;
-  fcb.mtime = time(0);
-  fcb.ctime = time(0);
-  fcb.atime = time(0);
-  fcb.uid = getuid();
-  fcb.gid = getgid();
-  fcb.nlink++;
-
-  if (is_directory)
-    fcb.mode |= S_IFDIR;
-
+  if (log_write_summary() != UNQLITE_OK || fdatasync(log_fd) != 0)
+    return UNQLITE_IOERR;
 
-  uuid_t uuid_to_fcb;
-  uuid_generate_random(uuid_to_fcb);
-		
-  int rc = unqlite_kv_store(pDb, uuid_to_fcb, KEY_SIZE, &fcb, sizeof(myfcb));
-
-  if( rc != UNQLITE_OK )
-    error_handler(rc);
+  size_t size = 2 * sizeof(uint32_t) + segment_log.count * sizeof(myfs_segment_t);
+  uint32_t *table = malloc(size);
 
-  dirent_t dirent = {0};
-  strcpy(dirent.name, filename);
-  uuid_copy(dirent.uuid, uuid_to_fcb);
+  table[0] = segment_log.count;
+  table[1] = segment_log.head;
 
-  rc = app(parent_directory->file_data_id, &dirent, sizeof(dirent_t));
+  myfs_segment_t *segments = (myfs_segment_t *) (table + 2);
 
-  assert(rc == UNQLITE_OK);
+  for (uint32_t s = 0; s < segment_log.count; s++)
+    segments[s] = segment_log.cleaned[s] ? (myfs_segment_t) {0, 0} : segment_log.segments[s];
 
-  // Don't forget to update the stored fcb (later)
-  parent_directory->size++;
+  db_put(segments_uuid, table, size);
 
-  db_put(parent_uuid, parent_directory, sizeof(myfcb));
-  
-  if (uuid_is_null(parent_uuid))
-    cached_root_fcb = *parent_directory;
+  free(table);
 
+  segment_log.dirty = false;
 
-  return fcb;
+  return UNQLITE_OK;
 }
 
-
-void fill_stbuf(struct stat *stbuf, myfcb *inode, ino_t number)
+/*
+  Fetches a record from wherever it is kept. For a block of the log, where
+  it is there is left in loc.
+ */
+static int store_fetch(uuid_t key, void *data, unqlite_int64 *size, myfs_log_loc_t *loc)
 {
-  stbuf->st_ino   = number;
-  stbuf->st_mode  = inode->mode;
-  stbuf->st_uid   = inode->uid;
-  stbuf->st_gid   = inode->gid;
-  stbuf->st_size  = inode->size;
-  stbuf->st_mtime = inode->mtime;
-  stbuf->st_ctime = inode->ctime;
-  stbuf->st_atime = inode->atime;
-}
+  if (is_data_key(key))
+    return data_read(key, data, size);
 
-// The functions which follow are handler functions for various things a filesystem needs to do:
-// reading, getting attributes, truncating, etc. They will be called by FUSE whenever it needs
-// your filesystem to do something, so this is where functionality goes.
+  if (is_log_key(key))
+    return log_read(key, data, size, loc);
 
-// Get file and directory attributes (meta-data).
-// Read 'man 2 stat' and 'man 2 chmod'.
-static int myfs_getattr(const char *path, struct stat *stbuf)
+  return unqlite_kv_fetch(pDb, key, KEY_SIZE, data, size);
+}
+
+int cache_put(myfs_shards_t *shards, uuid_t key, void *data, size_t size)
 {
-  write_log("myfs_getattr(path=\"%s\", statbuf=0x%08x)\n", path, stbuf);
-  
-  memset(stbuf, 0, sizeof(struct stat));
 
-  myfcb current_directory = cached_root_fcb;
+  int rc = 0;
 
+  if (uuid_is_null(key))
+    return db_put(key, data, size);
 
-  uuid_t parent_uuid;
-  uuid_copy(parent_uuid, zero_uuid);
-  
-  char copy[strlen(path) + 1];
-  strcpy(copy, path);
+  myfs_cache_t *cache = myfs_shard(shards, key);
   
-  char *p = copy;
-  char *s = NULL;
+  pthread_rwlock_wrlock(&(cache->lock));
 
-  bool finished = strcmp(path, "/") == 0;
+  myfs_node_t * cached_data = myfs_cache_get(cache, key); 
+  
+  if (cached_data) {
 
-  while(!finished) {
+    // Write data to cached data
+    memcpy(cached_data->data, data, size);
 
-    finished = split_path(&p, &s);
-
-    if (!descend(s, &current_directory, parent_uuid))
-      return -ENOENT;
+    cached_data->absent = false;
+    
+  } else {
 
+    cached_data = myfs_mk_node(key, data, size);
 
+    cache_insert(cache, cached_data);
+    
   }
 
-  fill_stbuf(stbuf, &current_directory, 10);
-  
-  return 0;
+  myfs_node_dirty(cache, cached_data);
+
+  cache_balance_dirty(cache);
+
+  pthread_rwlock_unlock(&(cache->lock));
+
+  return rc;
 }
 
-// Read a directory.
-// Read 'man 2 readdir'.
-static int myfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
-  write_log("write_readdir(path=\"%s\", buf=0x%08x, filler=0x%08x, offset=%lld, fi=0x%08x)\n", path, buf, filler, offset, fi);
+/*
+  A hit holds the shard lock shared, so readers of a shard run side by side.
+  A miss takes it exclusively and looks again, another thread may have read
+  the block in meanwhile. A key the store has nothing under is cached too,
+  as a node of zeroes, so that a hole in a file is only looked up once.
+ */
+int cache_fetch(myfs_shards_t *shards, uuid_t key, void *data, unqlite_int64 size)
+{
 
-  filler(buf, ".", NULL, 0);
-  filler(buf, "..", NULL, 0);
+  int rc = 0;
 
-  myfcb current_directory = cached_root_fcb;
+  if (uuid_is_null(key))
+    return unqlite_kv_fetch(pDb, key, KEY_SIZE, data, &size);
 
-  uuid_t parent_uuid;
-  uuid_copy(parent_uuid, zero_uuid);
-  
-  char copy[strlen(path) + 1];
-  strcpy(copy, path);
-  
-  char *p = copy;
-  char *s = NULL;
+  myfs_cache_t *cache = myfs_shard(shards, key);
+
+  pthread_rwlock_rdlock(&(cache->lock));
 
-  bool finished = strcmp(path, "/") == 0;
+  myfs_node_t * cached_data = myfs_cache_get(cache, key); 
 
-  while(!finished) {
+  if (cached_data) {
 
-    finished = split_path(&p, &s);
+    memcpy(data, cached_data->data, size);
 
-    if (!descend(s, &current_directory, parent_uuid))
-      return -ENOENT;
+    if (cached_data->absent)
+      rc = UNQLITE_NOTFOUND;
 
+    pthread_rwlock_unlock(&(cache->lock));
 
+    return rc;
   }
+
+  pthread_rwlock_unlock(&(cache->lock));
+
+  pthread_rwlock_wrlock(&(cache->lock));
+
+  cached_data = myfs_hashtable_get(cache->hashtable, key);
   
-  if (current_directory.size) {
+  if (cached_data) {
+
+    memcpy(data, cached_data->data, size);
+
+    if (cached_data->absent)
+      rc = UNQLITE_NOTFOUND;
     
-    dirent_t * entries = calloc(current_directory.size, sizeof(dirent_t));
+  } else {
 
-    db_get(current_directory.file_data_id, entries, current_directory.size * sizeof(dirent_t));
+    unqlite_int64 found = size;
+    myfs_log_loc_t loc;
 
-    for (int i = 0; i < current_directory.size; i++)
-      filler(buf, entries[i].name, NULL, 0);
+    rc = store_fetch(key, data, &found, &loc);
 
-    free(entries);
-  }
-  
-  return 0;
-}
+    // A record shorter than asked for, such as an fcb from before a field
+    // was added, reads back zero filled
+    if (rc == UNQLITE_OK && found < size)
+      memset((char *) data + found, 0, size - found);
 
+    if (rc == UNQLITE_NOTFOUND)
+      memset(data, 0, size);
 
-static void get_singlely_block_uuid(myfcb *fcb, int index, uuid_t uuid_to_block)
-{
-  index = index - 13;
+    if (rc == UNQLITE_OK || rc == UNQLITE_NOTFOUND) {
 
-  indirect_block_t indirect_block = {0};
+      cached_data = myfs_mk_node(key, data, size);
+      cached_data->absent = rc == UNQLITE_NOTFOUND;
 
-  db_get_block(fcb->singley_indirect_blocks, &indirect_block, sizeof(indirect_block_t));
-  
-  uuid_copy(uuid_to_block, indirect_block.uuid[index]);
+      if (is_log_key(key)) {
+	cached_data->located = true;
+	cached_data->loc = loc;
+      }
+
+      cache_insert(cache, cached_data);
+    }
+    
+  }
+
+  pthread_rwlock_unlock(&(cache->lock));
+
+  return rc;
 }
 
-static void get_doubley_block_uuid(myfcb *fcb, int index, uuid_t uuid_to_block)
+/*
+  Copies part of a block out of the cache if it is there, without reading
+  it in or counting a miss if it isn't
+ */
+bool cache_peek(myfs_shards_t *shards, uuid_t key, void *data, size_t offset, size_t size)
 {
+  myfs_cache_t *cache = myfs_shard(shards, key);
 
-  index = index - 13 - 256;
+  pthread_rwlock_rdlock(&(cache->lock));
 
-  int fst_index = index / 256;
-  int snd_index = index % 256;
+  myfs_node_t *cached_data = myfs_hashtable_get(cache->hashtable, key);
 
-  indirect_block_t indirect_block_f = {0};
-  indirect_block_t indirect_block_s = {0};
+  if (cached_data)
+    memcpy(data, (char *) cached_data->data + offset, size);
 
-  db_get_block(fcb->doubley_indirect_blocks, &indirect_block_f, sizeof(indirect_block_t));
-  db_get_block(indirect_block_f.uuid[fst_index], &indirect_block_s, sizeof(indirect_block_t));
+  pthread_rwlock_unlock(&(cache->lock));
 
-  uuid_copy(uuid_to_block, indirect_block_s.uuid[snd_index]);
+  return cached_data != NULL;
 }
 
-static void get_block_uuid(myfcb *fcb, int index, uuid_t uuid_to_block)
+/*
+  Writes every dirty block in a cache back to the store
+ */
+void cache_flush(myfs_shards_t *shards)
 {
-      
-  if (index < 13) {
+  for (int i = 0; i < shards->count; i++) {
 
-    uuid_copy(uuid_to_block, fcb->direct_blocks[index]);
-    
-  } else if (index < 256 + 13) {
+    myfs_cache_t *cache = shards->shards[i];
 
-    get_singlely_block_uuid(fcb, index, uuid_to_block);
+    pthread_rwlock_wrlock(&(cache->lock));
 
-    
-  } else if (index < 256 + 13 + 256 * 256) {
+    flush_cache(cache);
 
-    get_doubley_block_uuid(fcb, index, uuid_to_block);
-    
+    pthread_rwlock_unlock(&(cache->lock));
   }
-    
-  
 }
 
-static void uninitialize_block(uuid_t uuid_to_indirect_block)
+/*
+  Forgets a block, so that it is never written back
+ */
+void cache_forget(myfs_shards_t *shards, uuid_t key)
 {
-  db_rem(uuid_to_indirect_block);
-  uuid_copy(uuid_to_indirect_block, zero_uuid);
+  myfs_cache_t *cache = myfs_shard(shards, key);
+
+  pthread_rwlock_wrlock(&(cache->lock));
+
+  cache_discard(cache, key);
+
+  pthread_rwlock_unlock(&(cache->lock));
 }
 
-static void rem_direct_block(uuid_t uuid_of_fcb, myfcb *fcb, int index)
+int db_put_block(uuid_t key, void *data, size_t size)
 {
-  uninitialize_block(fcb->direct_blocks[index]);
+  return cache_put(cache, key, data, size);
 }
 
-static void rem_singley_indirect_block(uuid_t uuid_of_fcb, myfcb *fcb, int index)
+int db_get_block(uuid_t key, void *data, unqlite_int64 size)
 {
-  index = index - 13;
+  return cache_fetch(cache, key, data, size);
+}
 
-  indirect_block_t indirect_block_f = {0};
+/*
+  Fcbs are kept in the inode table, a cache of their own, so that a scan
+  through file data can't push out the metadata of hot files
+ */
+int db_put_fcb(uuid_t key, myfcb *fcb)
+{
+  return cache_put(itable, key, fcb, sizeof(myfcb));
+}
 
-  db_get_block(fcb->singley_indirect_blocks, &indirect_block_f, sizeof(indirect_block_t));
+int db_get_fcb(uuid_t key, myfcb *fcb)
+{
+  return cache_fetch(itable, key, fcb, sizeof(myfcb));
+}
 
-  uninitialize_block(indirect_block_f.uuid[index]);
+int db_put(uuid_t key, void *data, size_t size)
+{
+  if (is_data_key(key))
+    return data_write(key, data, size);
 
-  db_put_block(fcb->singley_indirect_blocks, &indirect_block_f, sizeof(indirect_block_t));
+  if (is_log_key(key)) {
+    myfs_log_loc_t loc;
+    return log_write(key, data, size, NULL, &loc);
+  }
 
-  if (index == 0)
-    uninitialize_block(fcb->singley_indirect_blocks);
+  __atomic_add_fetch(&transaction_bytes, size, __ATOMIC_RELAXED);
 
+  return unqlite_kv_store(pDb, key, KEY_SIZE, data, size);
 }
 
-static void rem_doubley_indirect_block(uuid_t uuid_of_fcb, myfcb *fcb, int index)
+/*
+  Writes a block of a cache back. A block of the log takes along where its
+  last copy is, if the node knows, and learns where the new one went.
+ */
+int db_put_node(myfs_node_t *node)
 {
-  index = index - 13 - 256;
+  if (!is_log_key(node->key))
+    return db_put(node->key, node->data, node->size);
 
-  int fst_index = index / 256;
-  int snd_index = index % 256;
-
-  indirect_block_t indirect_block_f = {0};
-  indirect_block_t indirect_block_s = {0};
-
-  // Uninitialize doubley indirect block
+  int rc = log_write(node->key, node->data, node->size, node->located ? &(node->loc) : NULL, &(node->loc));
 
-  db_get_block(fcb->doubley_indirect_blocks, &indirect_block_f, sizeof(indirect_block_t));
-  db_get_block(indirect_block_f.uuid[fst_index], &indirect_block_s, sizeof(indirect_block_t));
+  node->located = rc == UNQLITE_OK;
 
-  uninitialize_block(indirect_block_s.uuid[snd_index]);
+  return rc;
+}
 
-  if (snd_index == 0)
-    uninitialize_block(indirect_block_f.uuid[fst_index]);
+int db_get(uuid_t key, void *data, unqlite_int64 size)
+{
+  myfs_log_loc_t loc;
 
-  if (index == 0)
-    uninitialize_block(fcb->doubley_indirect_blocks);
-  
+  return store_fetch(key, data, &size, &loc);
 }
 
-static void rem_block(uuid_t uuid_of_fcb, myfcb *fcb, int index)
+
+int db_rem(uuid_t key)
 {
-  if (index < 13) {
+  // A deleted block must not be written back later
+  cache_forget(cache, key);
+  cache_forget(itable, key);
 
-    rem_direct_block(uuid_of_fcb, fcb, index);
+  // A block of the data file goes back to the allocator, the store never had it
+  if (is_data_key(key)) {
 
-  } else if (index < 256 + 13) {
+    pthread_mutex_lock(&alloc_lock);
+    myfs_alloc_free(&allocator, data_block(key));
+    pthread_mutex_unlock(&alloc_lock);
 
-    rem_singley_indirect_block(uuid_of_fcb, fcb, index);
-    
-  }  else if (index < 256 + 13 + 256 * 256) {
-    
-    rem_doubley_indirect_block(uuid_of_fcb, fcb, index);
-    
+    return 0;
   }
 
-  db_put(uuid_of_fcb, fcb, sizeof(fcb));
-}
+  __atomic_add_fetch(&transaction_bytes, KEY_SIZE, __ATOMIC_RELAXED);
 
+  // Only the record of where a block of the log is goes, its slot is left to the cleaner
+  if (is_log_key(key)) {
+    log_forget(key);
+    return 0;
+  }
 
-static void initialize_block(uuid_t uuid_to_indirect_block)
-{
-  uuid_generate_random(uuid_to_indirect_block);
-  db_put_block(uuid_to_indirect_block, &empty_indirect_block, sizeof(indirect_block_t));
+  return unqlite_kv_delete(pDb, key, KEY_SIZE);
 }
 
-static void add_direct_block(myfcb *fcb, int index)
+/*
+  Writes back a list of extents which has outgrown the fcb, or removes the
+  record of one which fits in it again. Called before the fcb is stored.
+ */
+static void put_handle_extents(myfs_handle_t *handle)
 {
-  initialize_block(fcb->direct_blocks[index]);
+  myfcb *fcb = &(handle->fcb);
+
+  if (!handle->extents_dirty)
+    return;
+
+  if (fcb->extent_count > INLINE_EXTENTS)
+    db_put(fcb->file_data_id, handle->extents, fcb->extent_count * sizeof(extent_t));
+  else if (handle->extents_spilled)
+    db_rem(fcb->file_data_id);
+
+  handle->extents_spilled = fcb->extent_count > INLINE_EXTENTS;
+  handle->extents_dirty = false;
 }
 
-static void add_singley_indirect_block(uuid_t uuid_of_fcb, myfcb *fcb, int index)
+/*
+  Writes the chunks of the data file's bitmap which changed since the last commit
+ */
+static void alloc_write()
 {
-  indirect_block_t indirect_block_f = {0};
+  uuid_t key;
 
-  index = index - 13;
+  for (uint64_t i = 0; i < allocator.chunks; i++) {
 
-  // Initialize singley indirect block
-  if (index == 0)
-    initialize_block(fcb->singley_indirect_blocks);
+    if (!allocator.dirty[i])
+      continue;
 
-  db_get_block(fcb->singley_indirect_blocks, &indirect_block_f, sizeof(indirect_block_t));
+    derive_key(alloc_uuid, i + 1, key);
+    db_put(key, allocator.used + i * ALLOC_CHUNK_WORDS, BLOCK_SIZE);
 
-  initialize_block(indirect_block_f.uuid[index]);
+    allocator.dirty[i] = false;
+  }
+}
+
+/*
+  Writes the fcbs of open files which have changed into the transaction,
+  so that a commit never has a file's blocks without its size. The handles
+  stay dirty, their dentries are only refreshed on flush or release.
+ */
+static void handles_write()
+{
+  for (myfs_handle_t *h = handles->root.next; h != &(handles->root); h = h->next) {
 
+    pthread_rwlock_wrlock(&(h->lock));
 
-  db_put_block(fcb->singley_indirect_blocks, &indirect_block_f, sizeof(indirect_block_t));
+    if (h->dirty) {
+      put_handle_extents(h);
+      db_put_fcb(h->uuid, &(h->fcb));
+    }
+
+    pthread_rwlock_unlock(&(h->lock));
+  }
 }
 
-static void add_doubley_indirect_block(uuid_t uuid_of_fcb, myfcb *fcb, int index)
+/*
+  Orphans. The runs still queued on the reaper, and the files which were
+  unlinked while they were open, are written to the store under
+  orphans_uuid at every commit. They go in the same transaction as the
+  unlinks which made them and the deletes which reaped them, so after a
+  crash the record says exactly what is left to reclaim, and orphans_read
+  picks it up at mount. The record is a count of runs and a count of
+  files, followed by the runs and then the files' uuids.
+ */
+static void orphans_write()
 {
-  indirect_block_t indirect_block_f = {0};
-  indirect_block_t indirect_block_s = {0};
+  uint32_t counts[2] = {0, 0};
 
-  index = index - 13 - 256;
+  pthread_mutex_lock(&reaper_lock);
 
-  int fst_index = index / 256;
-  int snd_index = index % 256;
+  for (myfs_reap_t *r = reaper.head; r; r = r->next)
+    counts[0]++;
 
-  // Initialize doubley indirect block
-  if (index == 0)
-    initialize_block(fcb->doubley_indirect_blocks);
+  for (myfs_handle_t *h = handles->root.next; h != &(handles->root); h = h->next)
+    if (h->unlinked)
+      counts[1]++;
 
-  db_get_block(fcb->doubley_indirect_blocks, &indirect_block_f, sizeof(indirect_block_t));
+  if (!counts[0] && !counts[1]) {
 
-  if (snd_index == 0)
-    initialize_block(indirect_block_f.uuid[fst_index]);
+    pthread_mutex_unlock(&reaper_lock);
 
-  db_get_block(indirect_block_f.uuid[fst_index], &indirect_block_s, sizeof(indirect_block_t));
+    if (orphans_stored)
+      db_rem(orphans_uuid);
 
-  initialize_block(indirect_block_s.uuid[snd_index]);
+    orphans_stored = false;
 
-  db_put_block(fcb->doubley_indirect_blocks, &indirect_block_f, sizeof(indirect_block_t));
-  db_put_block(indirect_block_f.uuid[fst_index], &indirect_block_s, sizeof(indirect_block_t));
-  
+    return;
+  }
+
+  size_t size = sizeof(counts) + counts[0] * sizeof(myfs_packed_reap_t) + counts[1] * sizeof(uuid_t);
+  unsigned char *record = malloc(size);
+
+  memcpy(record, counts, sizeof(counts));
+
+  myfs_packed_reap_t *run = (myfs_packed_reap_t *) (record + sizeof(counts));
+
+  for (myfs_reap_t *r = reaper.head; r; r = r->next, run++) {
+    uuid_copy(run->base, r->base);
+    run->first = r->first;
+    run->count = r->count;
+  }
+
+  pthread_mutex_unlock(&reaper_lock);
+
+  unsigned char *file = (unsigned char *) run;
+
+  for (myfs_handle_t *h = handles->root.next; h != &(handles->root); h = h->next)
+    if (h->unlinked) {
+      uuid_copy(file, h->uuid);
+      file += sizeof(uuid_t);
+    }
+
+  db_put(orphans_uuid, record, size);
+  orphans_stored = true;
+
+  free(record);
 }
 
-static void add_block(uuid_t uuid_of_fcb, myfcb *fcb, int index)
+/*
+  Reads the data file's bitmap back from the store, a chunk at a time until
+  one is missing
+ */
+static void alloc_read()
 {
+  uuid_t key;
+  uint64_t chunk[ALLOC_CHUNK_WORDS];
 
-  if (index < 13) {
+  for (uint64_t i = 0; ; i++) {
 
-    add_direct_block(fcb, index);
+    derive_key(alloc_uuid, i + 1, key);
 
-  } else if (index < 256 + 13) {
+    if (db_get(key, chunk, BLOCK_SIZE) != UNQLITE_OK)
+      break;
 
-    add_singley_indirect_block(uuid_of_fcb, fcb, index);
-    
-  } else if (index < 256 + 13 + 256 * 256) {
+    myfs_alloc_grow(&allocator, i + 1);
 
-    add_doubley_indirect_block(uuid_of_fcb, fcb, index);
-    
+    memcpy(allocator.used + i * ALLOC_CHUNK_WORDS, chunk, BLOCK_SIZE);
+    allocator.dirty[i] = false;
   }
-
 }
 
-static void set_block(myfcb *fcb, int index, block_t *block)
+/*
+  Reads the table of the log's segments back from the store, along with the
+  summary of the head segment. Slots of the head past those used were
+  written after the last commit, and are written over. Fails if the
+  summary can't be read.
+ */
+static int log_read_segments()
 {
+  unqlite_int64 size = 0;
+  uint32_t *table = db_get_alloc(segments_uuid, &size);
 
-  uuid_t uuid_to_block;
-  get_block_uuid(fcb, index, uuid_to_block);
-    
-  db_put_block(uuid_to_block, block, sizeof(block_t));
-    
+  if (!table)
+    return UNQLITE_OK;
+
+  myfs_log_grow(&segment_log, table[0]);
+  segment_log.head = table[1];
+
+  memcpy(segment_log.segments, table + 2, table[0] * sizeof(myfs_segment_t));
+
+  free(table);
+
+  if (pread(log_fd, segment_log.summary, sizeof(segment_log.summary), summary_offset(segment_log.head)) != sizeof(segment_log.summary))
+    return UNQLITE_IOERR;
+
+  return UNQLITE_OK;
 }
 
-static void get_block(myfcb *fcb, int index, block_t *block)
+/*
+  How much the log has written, and how much of that was the cleaner
+  moving blocks which were still live
+ */
+static void log_report(FILE *f)
 {
+  unsigned long written = segment_log.stats.appended - segment_log.stats.relocated;
 
-  uuid_t uuid_to_block;
-  get_block_uuid(fcb, index, uuid_to_block);
-    
-  db_get_block(uuid_to_block, block, sizeof(block_t));
-  
+  fprintf(f, "log: %u segments, %lu blocks written, %lu relocated by the cleaner, %lu segments cleaned, write amplification %.2f\n",
+	  segment_log.count, written, segment_log.stats.relocated, segment_log.stats.cleaned,
+	  written ? (double) segment_log.stats.appended / written : 1.0);
 }
 
-
-static int _internal_resize_(uuid_t uuid_of_fcb, myfcb *fcb, size_t newsize)
+/*
+  Group commit. UnQLite gathers every change since the last commit into one
+  transaction, and nothing in it is safe from a crash until it is committed.
+  The fcbs of open files and the caches are written back into the
+  transaction first so that it always ends between two whole operations,
+  which means fs_lock is held alone. A transaction is committed once it is
+  commit_interval seconds old or has written commit_bytes
+  (-o commit_interval, -o commit_bytes), on fsync, and at unmount.
+  Auto-commit on close is turned off so that a store is never closed with
+  half an operation in it.
+
+  Blocks in the data file are written in place, outside the transaction.
+  They are synced before the commit, so that extents never reach the disk
+  ahead of the data they map, and the chunks of the bitmap which changed go
+  into the transaction with them. The log is synced likewise, and its table
+  of segments goes into the transaction.
+ */
+int db_commit()
 {
-  size_t blocks_supplied = size_to_block(fcb->size) + (fcb->size % BLOCK_SIZE != 0);
-  size_t blocks_required = size_to_block(newsize)   + 1;
+  // Ahead of the caches, which the fcbs of open files go through
+  handles_write();
+  orphans_write();
 
-  if (blocks_required > blocks_supplied) {
+  cache_flush(cache);
+  cache_flush(itable);
 
-    for (int i = blocks_supplied; i < blocks_required; i++)
-      add_block(uuid_of_fcb, fcb, i);
-    
+  // The store must not point at blocks which didn't reach the data file
+  int rc = UNQLITE_OK;
+
+  if (fdatasync(data_fd) != 0) {
+    write_log("db_commit: syncing the data file failed: %s\n", strerror(errno));
+    rc = UNQLITE_IOERR;
   }
 
-  if (blocks_required < blocks_supplied) {
+  if (rc == UNQLITE_OK)
+    alloc_write();
 
-    for (int i = blocks_required - 1; i >= blocks_required; i--)
-      rem_block(uuid_of_fcb, fcb, i);
+  // The store must not point into a log which didn't reach the disk
+  if (rc == UNQLITE_OK)
+    rc = log_sync();
 
+  if (rc == UNQLITE_OK)
+    rc = unqlite_commit(pDb);
+
+  // Blocks freed and segments cleaned in the transaction may now be used again
+  if (rc == UNQLITE_OK) {
+    myfs_alloc_settle(&allocator);
+    myfs_log_settle(&segment_log);
   }
 
-  fcb->size = newsize;
-  
-  db_put(uuid_of_fcb, fcb, sizeof(myfcb));
-    
-}
+  if (rc == UNQLITE_OK)
+    rc = unqlite_begin(pDb);
 
-static int _internal_put_(myfcb *fcb, const char *buf, size_t bytes, off_t start)
-{
+  if (rc != UNQLITE_OK)
+    write_log("db_commit: failed with %d\n", rc);
 
-  block_t block;
+  transaction_start = time(0);
+  transaction_bytes = 0;
 
-  int i = size_to_block(start); // block to start with
-  
-  while(bytes) {
+  return rc;
+}
 
-    size_t s = start % (BLOCK_SIZE);
-    size_t r = (BLOCK_SIZE - s);
-    size_t l = bytes < r ? bytes : r;
+/*
+  Whether the open transaction has gathered enough to be committed
+ */
+bool db_commit_due()
+{
+  return time(0) - transaction_start >= commit_interval
+    || __atomic_load_n(&transaction_bytes, __ATOMIC_RELAXED) >= commit_bytes;
+}
 
-    start = 0;
+/*
+  Deletes up to limit of the blocks queued on a reaper
+ */
+void reaper_run(myfs_reaper_t *reaper, uint64_t limit)
+{
+  uuid_t key;
 
-    memset(&block, 0, sizeof(block_t));
-    get_block(fcb, i, &block);
+  while (limit--) {
 
-    char *dst = ((char *) (&block)) + s;
-    
-    memcpy(dst, buf, l);
+    pthread_mutex_lock(&reaper_lock);
+    bool more = myfs_reaper_next(reaper, key);
+    pthread_mutex_unlock(&reaper_lock);
 
-    set_block(fcb, i, &block);
+    if (!more)
+      break;
 
-    bytes -= l;
-    buf   += l;
-    
-    i++;
+    db_rem(key);
   }
-    
-  
-  return 0;
 }
 
-static int _internal_get_(myfcb *fcb, char *buf, size_t bytes, off_t start)
+/*
+  Whether the reaper has blocks queued
+ */
+static bool reaper_pending()
 {
+  pthread_mutex_lock(&reaper_lock);
+  bool pending = reaper.head != NULL;
+  pthread_mutex_unlock(&reaper_lock);
 
-  block_t block;
+  return pending;
+}
 
-  int i = size_to_block(start); // block to start with
-  
-  while(bytes) {
+/*
+  Work which was put off is done on a thread of its own, so that no request
+  has to wait for it. The blocks of removed files are deleted a batch at a
+  time alongside other requests, and the transaction is committed once it
+  is due. The thread wakes every second, or straight away while the reaper
+  has work.
+ */
+static void *background_run(void *arg)
+{
+  bool cleaning = false;
 
-    size_t s = start % (BLOCK_SIZE);
-    size_t r = (BLOCK_SIZE - s);
-    size_t l = bytes < r ? bytes : r;
+  pthread_mutex_lock(&background_lock);
 
-    start = 0;
+  while (!background_stop) {
 
-    memset(&block, 0, sizeof(block_t));
-    get_block(fcb, i, &block);
+    if (!reaper_pending() && !cleaning) {
 
-    char *dst = ((char *) (&block)) + s;
-    
-    memcpy(buf, dst, l);
+      struct timespec wake;
+      clock_gettime(CLOCK_REALTIME, &wake);
+      wake.tv_sec++;
 
-    bytes -= l;
-    buf   += l;
-    
-    i++;
-  }
-  
-  return 0;
-}
+      pthread_cond_timedwait(&background_wake, &background_lock, &wake);
+    }
 
+    pthread_mutex_unlock(&background_lock);
 
-// Read a file.
-// Read 'man 2 read'.
-static int myfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi){
-  write_log("myfs_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n", path, buf, size, offset, fi);
+    pthread_rwlock_rdlock(&fs_lock);
 
-  // TODO
-  myfcb fcb = {0}; uuid_t uuid; uuid_copy(uuid, zero_uuid);
+    reaper_run(&reaper, REAP_BATCH);
+    cleaning = log_clean();
+    bool due = db_commit_due();
 
-  if( traverse(path, uuid, &fcb) ) {
+    pthread_rwlock_unlock(&fs_lock);
 
-    size_t corrected_size = fcb.size < size ? fcb.size : size;
+    if (due) {
+      pthread_rwlock_wrlock(&fs_lock);
+      db_commit();
+      pthread_rwlock_unlock(&fs_lock);
+    }
+
+    pthread_mutex_lock(&background_lock);
+  }
+
+  pthread_mutex_unlock(&background_lock);
+
+  return NULL;
+}
+
+void print_uuid(uuid_t uuid)
+{
+
+  char str[64];
+  uuid_unparse_lower(uuid, str);
+  printf("uuid %s\n", str);
+}
+
+bool split_path(char **p, char **s)
+{
+  bool f = false;
+  
+  (*p)++;
+  (*s) = (*p);
+  while(**p != '/' && **p != '\0')
+    (*p)++;
+
+  if (**p == '\0')
+    f = true;
+
+  **p = '\0';
+
+  return f;
+}
+
+void ascend_path(char *p)
+{
+  char * s = p;
+  
+  p = (strlen(p) - 1) + p;
+ 
+  while(*p != '/')
+    p--;
+
+  *p = '\0';
+
+  if (s == p) {
+    *p++ = '/';
+    *p++ = '\0';
+  }
+}
+
+/*
+  The page size a store was made with, or 0 if there is no store yet.
+  UnQLite opens a store with the library's page size rather than the one in
+  its header, so the two must be made to agree before it is opened.
+ */
+static size_t store_page_size(const char *name)
+{
+  unsigned char raw[4];
+  size_t size = 0;
+
+  FILE *f = fopen(name, "rb");
+
+  if (!f)
+    return 0;
+
+  if (fseek(f, STORE_PAGE_SIZE_OFFSET, SEEK_SET) == 0 && fread(raw, 1, 4, f) == 4)
+    size = ((size_t) raw[0] << 24) | (raw[1] << 16) | (raw[2] << 8) | raw[3];
+
+  fclose(f);
+
+  return size;
+}
+
+/*
+  Derives the key of the n'th record belonging to an object from the object's key
+ */
+void derive_key(uuid_t base, uint64_t n, uuid_t key)
+{
+  uuid_copy(key, base);
+
+  for (int i = 0; i < 8; i++)
+    key[KEY_SIZE - 1 - i] ^= (n >> (8 * i)) & 0xff;
+}
+
+typedef struct
+{
+  unsigned char *data;
+  unqlite_int64 size;
+  
+} db_buffer_t;
+
+static int db_buffer_consumer(const void *data, unsigned int size, void *user)
+{
+  db_buffer_t *buffer = user;
+
+  buffer->data = realloc(buffer->data, buffer->size + size);
+  memcpy(buffer->data + buffer->size, data, size);
+  buffer->size += size;
+
+  return UNQLITE_OK;
+}
+
+/*
+  Fetches a record of unknown size, the caller frees it. Returns NULL if there is no such record
+ */
+void *db_get_alloc(uuid_t key, unqlite_int64 *size)
+{
+  db_buffer_t buffer = {0};
+
+  int rc = unqlite_kv_fetch_callback(pDb, key, KEY_SIZE, db_buffer_consumer, &buffer);
+
+  *size = buffer.size;
+
+  if (rc != UNQLITE_OK) {
+    free(buffer.data);
+    return NULL;
+  }
+
+  return buffer.data ? buffer.data : calloc(1, 1);
+}
+
+static dir_header_t *dir_get_header(myfcb *directory)
+{
+  unqlite_int64 size = 0;
+  dir_header_t *header = db_get_alloc(directory->file_data_id, &size);
+
+  if (!header) {
+
+    // A directory starts out with a single bucket covering every hash
+    header = calloc(1, sizeof(dir_header_t) + sizeof(dir_index_t));
+    header->buckets = 1;
+    header->next_bucket = 1;
+  }
+
+  return header;
+}
+
+static void dir_put_header(myfcb *directory, dir_header_t *header)
+{
+  db_put(directory->file_data_id, header, sizeof(dir_header_t) + header->buckets * sizeof(dir_index_t));
+}
+
+/*
+  Returns the position in the index of the bucket whose range covers the hash
+ */
+static int dir_find_bucket(dir_header_t *header, uint32_t hash)
+{
+  int l = 0;
+  int r = header->buckets - 1;
+
+  while (l < r) {
+
+    int m = (l + r + 1) / 2;
+
+    if (header->index[m].hash <= hash)
+      l = m;
+    else
+      r = m - 1;
+  }
+
+  return l;
+}
+
+static unsigned char *dir_get_bucket(myfcb *directory, uint32_t bucket, unqlite_int64 *size)
+{
+  uuid_t key;
+  derive_key(directory->file_data_id, bucket + 1, key);
+
+  return db_get_alloc(key, size);
+}
+
+static void dir_put_bucket(myfcb *directory, uint32_t bucket, unsigned char *data, unqlite_int64 size)
+{
+  uuid_t key;
+  derive_key(directory->file_data_id, bucket + 1, key);
+
+  if (size)
+    db_put(key, data, size);
+  else
+    db_rem(key);
+}
+
+/*
+  Orders dirents by (hash, name), comparing the names only when the hashes are equal
+ */
+static int dirent_compare(uint32_t hash, const char *name, size_t length, packed_dirent_t *dirent)
+{
+  if (hash != dirent->hash)
+    return hash < dirent->hash ? -1 : 1;
+
+  int c = memcmp(name, dirent->name, length < dirent->length ? length : dirent->length);
+
+  if (c)
+    return c;
+
+  return (int) length - (int) dirent->length;
+}
+
+/*
+  Returns the offset at which the name is, or would be, stored in a bucket
+ */
+static unqlite_int64 dir_bucket_search(unsigned char *data, unqlite_int64 size, uint32_t hash, const char *name, bool *found)
+{
+  size_t length = strlen(name);
+
+  unqlite_int64 offset = 0;
+
+  *found = false;
+
+  while (offset < size) {
+
+    packed_dirent_t *dirent = (packed_dirent_t *) (data + offset);
+
+    int c = dirent_compare(hash, name, length, dirent);
+
+    if (c == 0)
+      *found = true;
+
+    if (c <= 0)
+      break;
+
+    offset += PACKED_DIRENT_SIZE(dirent->length);
+  }
+
+  return offset;
+}
+
+/* Takes a directory inode and returns the given filename's dirent (filename -> uuid)
+ */
+bool search_file(const char* name, myfcb *directory_inode, dirent_t *dirent)
+{
+  bool retval = false;
+
+  // No name that long was ever let in
+  if (!directory_inode->size || strlen(name) > MAX_FILE_NAME)
+    return retval;
+
+  uint32_t hash = hash_string(name);
+
+  dir_header_t *header = dir_get_header(directory_inode);
+
+  unqlite_int64 size = 0;
+  unsigned char *data = dir_get_bucket(directory_inode, header->index[dir_find_bucket(header, hash)].bucket, &size);
+
+  unqlite_int64 offset = dir_bucket_search(data, size, hash, name, &retval);
+
+  if (retval) {
+
+    packed_dirent_t *found = (packed_dirent_t *) (data + offset);
+
+    memcpy(dirent->name, found->name, found->length);
+    dirent->name[found->length] = '\0';
+
+    uuid_copy(dirent->uuid, found->uuid);
+  }
+
+  free(data);
+  free(header);
+
+  return retval;
+}
+
+/*
+  Inserts a name into a directory, splitting the bucket it lands in if it overflows
+ */
+static void dir_insert(myfcb *directory, const char *name, uuid_t uuid, mode_t mode)
+{
+  uint32_t hash = hash_string(name);
+  size_t length = strlen(name);
+
+  dir_header_t *header = dir_get_header(directory);
+
+  int position = dir_find_bucket(header, hash);
+  uint32_t bucket = header->index[position].bucket;
+
+  unqlite_int64 size = 0;
+  unsigned char *data = dir_get_bucket(directory, bucket, &size);
+
+  bool found;
+  unqlite_int64 offset = dir_bucket_search(data, size, hash, name, &found);
+
+  data = realloc(data, size + PACKED_DIRENT_SIZE(length));
+  memmove(data + offset + PACKED_DIRENT_SIZE(length), data + offset, size - offset);
+  size += PACKED_DIRENT_SIZE(length);
+
+  packed_dirent_t *dirent = (packed_dirent_t *) (data + offset);
+  dirent->hash = hash;
+  uuid_copy(dirent->uuid, uuid);
+  dirent->type = MODE_TO_TYPE(mode);
+  dirent->length = length;
+  memcpy(dirent->name, name, length);
+
+  // Split at the first dirent past the middle, but never between two dirents with the same hash
+  unqlite_int64 split = 0;
+
+  if (size > DIR_BUCKET_SIZE) {
+
+    unqlite_int64 last = 0;
+
+    while (split < size / 2) {
+      last = split;
+      split += PACKED_DIRENT_SIZE(((packed_dirent_t *) (data + split))->length);
+    }
+
+    while (split < size && ((packed_dirent_t *) (data + split))->hash == ((packed_dirent_t *) (data + last))->hash) {
+      last = split;
+      split += PACKED_DIRENT_SIZE(((packed_dirent_t *) (data + split))->length);
+    }
+
+    // Every dirent past the middle shares a hash, split before them instead
+    if (split == size) {
+
+      uint32_t h = ((packed_dirent_t *) (data + last))->hash;
+
+      split = 0;
+
+      for (unqlite_int64 o = 0; ((packed_dirent_t *) (data + o))->hash != h; o += PACKED_DIRENT_SIZE(((packed_dirent_t *) (data + o))->length))
+	split = o + PACKED_DIRENT_SIZE(((packed_dirent_t *) (data + o))->length);
+    }
+  }
+
+  if (split == 0) {
+
+    dir_put_bucket(directory, bucket, data, size);
+
+  } else {
+
+    uint32_t new_bucket = header->next_bucket++;
+
+    header = realloc(header, sizeof(dir_header_t) + (header->buckets + 1) * sizeof(dir_index_t));
+
+    memmove(&(header->index[position + 2]), &(header->index[position + 1]), (header->buckets - position - 1) * sizeof(dir_index_t));
+
+    header->index[position + 1].hash = ((packed_dirent_t *) (data + split))->hash;
+    header->index[position + 1].bucket = new_bucket;
+    header->buckets++;
+
+    dir_put_bucket(directory, bucket, data, split);
+    dir_put_bucket(directory, new_bucket, data + split, size - split);
+    dir_put_header(directory, header);
+  }
+
+  free(data);
+  free(header);
+}
+
+/*
+  Removes a name from a directory, dropping its bucket once it is empty
+ */
+static bool dir_remove(myfcb *directory, const char *name, dirent_t *dirent)
+{
+  if (strlen(name) > MAX_FILE_NAME)
+    return false;
+
+  uint32_t hash = hash_string(name);
+
+  dir_header_t *header = dir_get_header(directory);
+
+  int position = dir_find_bucket(header, hash);
+  uint32_t bucket = header->index[position].bucket;
+
+  unqlite_int64 size = 0;
+  unsigned char *data = dir_get_bucket(directory, bucket, &size);
+
+  bool found;
+  unqlite_int64 offset = dir_bucket_search(data, size, hash, name, &found);
+
+  if (found) {
+
+    packed_dirent_t *removed = (packed_dirent_t *) (data + offset);
+    unqlite_int64 length = PACKED_DIRENT_SIZE(removed->length);
+
+    memcpy(dirent->name, removed->name, removed->length);
+    dirent->name[removed->length] = '\0';
+
+    uuid_copy(dirent->uuid, removed->uuid);
+
+    memmove(data + offset, data + offset + length, size - offset - length);
+    size -= length;
+
+    dir_put_bucket(directory, bucket, data, size);
+
+    // The first bucket covers the bottom of the hash space and always stays
+    if (size == 0 && position > 0) {
+
+      memmove(&(header->index[position]), &(header->index[position + 1]), (header->buckets - position - 1) * sizeof(dir_index_t));
+      header->buckets--;
+
+      dir_put_header(directory, header);
+    }
+  }
+
+  free(data);
+  free(header);
+
+  return found;
+}
+
+/*
+  Deletes every record belonging to a directory
+ */
+static void dir_free(myfcb *directory)
+{
+  dir_header_t *header = dir_get_header(directory);
+
+  for (int i = 0; i < header->buckets; i++)
+    dir_put_bucket(directory, header->index[i].bucket, NULL, 0);
+
+  db_rem(directory->file_data_id);
+
+  free(header);
+}
+
+int get_root_inode()
+{
+  return db_get(ROOT_OBJECT_KEY, &cached_root_fcb, sizeof(myfcb));
+}
+
+int set_root_inode()
+{
+  return db_put(ROOT_OBJECT_KEY, &cached_root_fcb, sizeof(myfcb));
+}
+
+dirent_t mk_dirent(const char *fname, uuid_t uuid)
+{
+  dirent_t d = {0};
+  strncpy(d.name, fname, MAX_FILE_NAME);
+  uuid_copy(d.uuid, uuid);
+  return d;
+}
+
+bool descend(const char *name, myfcb *current_directory, uuid_t parent_uuid)
+{
+  dirent_t dirent = {0};
+
+  if (search_file(name, current_directory, &dirent)) {
+
+    memset(current_directory, 0, sizeof(myfcb));
+
+    int rc = db_get_fcb(dirent.uuid, current_directory);
+
+    assert(rc == UNQLITE_OK);
+
+    uuid_copy(parent_uuid, dirent.uuid);
+    
+    return true;
+  }
+
+  return false;
+}
+
+
+/*
+  An open file's handle holds the most recent copy of its fcb
+ */
+static void overlay_handle(uuid_t uuid, myfcb *fcb)
+{
+  pthread_mutex_lock(&(handles->lock));
+
+  myfs_handle_t *handle = myfs_handles_get(handles, uuid);
+
+  if (handle) {
+    pthread_rwlock_rdlock(&(handle->lock));
+    *fcb = handle->fcb;
+    pthread_rwlock_unlock(&(handle->lock));
+  }
+
+  pthread_mutex_unlock(&(handles->lock));
+}
+
+/*
+  Resolves a path to its fcb, consulting the dentry cache first. On a miss the
+  parent is resolved (recursively, through the cache) and only the last
+  component is looked up in the store. The outcome is cached either way.
+ */
+bool traverse(const char *path, uuid_t fcb_uuid, myfcb *current_directory)
+{
+
+  if (strcmp(path, "/") == 0) {
+
+    *current_directory = cached_root_fcb;
+    uuid_copy(fcb_uuid, zero_uuid);
+
+    return true;
+  }
+
+  myfs_dentry_t dentry;
+
+  if (myfs_dcache_lookup(dcache, path, &dentry)) {
+
+    if (dentry.negative)
+      return false;
+
+    *current_directory = dentry.fcb;
+    uuid_copy(fcb_uuid, dentry.uuid);
+
+    overlay_handle(fcb_uuid, current_directory);
+
+    return true;
+  }
+
+  char parent[strlen(path) + 1]; strcpy(parent, path); ascend_path(parent);
+
+  if (!traverse(parent, fcb_uuid, current_directory))
+    return false;
+
+  if (!descend(strrchr(path, '/') + 1, current_directory, fcb_uuid)) {
+
+    myfs_dcache_put_negative(dcache, path);
+
+    return false;
+  }
+
+  myfs_dcache_put(dcache, path, fcb_uuid, current_directory);
+
+  overlay_handle(fcb_uuid, current_directory);
+
+  return true;
+  
+}
+
+/*
+  Puts an fcb in the store and refreshes the cached copies of it
+ */
+static void write_fcb(const char *path, uuid_t uuid, myfcb *fcb)
+{
+  db_put_fcb(uuid, fcb);
+
+  if (uuid_is_null(uuid))
+    cached_root_fcb = *fcb;
+  else
+    myfs_dcache_put(dcache, path, uuid, fcb);
+}
+
+/*
+  Writes an open file's fcb back through its handle, whose lock the caller
+  holds, so that the handles needn't be looked at
+ */
+static void write_handle_fcb(const char *path, myfs_handle_t *handle)
+{
+  put_handle_extents(handle);
+
+  write_fcb(path, handle->uuid, &(handle->fcb));
+
+  handle->dirty = false;
+}
+
+/*
+  Writes an fcb back to the store and refreshes the cached copies of it
+ */
+void update_fcb(const char *path, uuid_t uuid, myfcb *fcb)
+{
+  myfs_handle_t *handle = myfs_handles_get(handles, uuid);
+
+  // The extents an open file's fcb refers to go first. A copy of the fcb
+  // came from overlay_handle, so it refers to the same ones.
+  if (handle)
+    put_handle_extents(handle);
+
+  write_fcb(path, uuid, fcb);
+
+  if (handle && &(handle->fcb) != fcb) {
+
+    handle->fcb = *fcb;
+    handle->dirty = false;
+
+    myfs_handle_invalidate(handle);
+  }
+}
+
+/*
+  Creates an inode representing a file/directory and inserts it into a parents directory 
+ */
+myfcb create_inode(uuid_t parent_uuid, myfcb *parent_directory, const char *filename, bool is_directory, mode_t mode, uuid_t uuid_to_fcb)
+{
+
+  myfcb fcb;
+  memset(&fcb, 0, sizeof(myfcb));
+
+  uuid_generate_random(fcb.file_data_id);
+
+  fcb.mode = mode;
+  fcb.mtime = time(0);
+  fcb.ctime = time(0);
+  fcb.atime = time(0);
+  fcb.uid = getuid();
+  fcb.gid = getgid();
+  fcb.nlink++;
+  fcb.layout = default_layout;
+
+  if (is_directory)
+    fcb.mode |= S_IFDIR;
+
+
+  uuid_generate_random(uuid_to_fcb);
+		
+  int rc = db_put_fcb(uuid_to_fcb, &fcb);
+
+  if( rc != UNQLITE_OK )
+    error_handler(rc);
+
+  dir_insert(parent_directory, filename, uuid_to_fcb, fcb.mode);
+
+  parent_directory->size++;
+
+  db_put_fcb(parent_uuid, parent_directory);
+  
+  if (uuid_is_null(parent_uuid))
+    cached_root_fcb = *parent_directory;
+
+
+  return fcb;
+}
+
+
+/*
+  Creates a file/directory at the given path, keeping the dentry cache in step
+ */
+static int mk_inode(const char *path, bool is_directory, mode_t mode)
+{
+  char parent[strlen(path) + 1]; strcpy(parent, path); ascend_path(parent);
+
+  myfcb parent_directory = {0}; uuid_t parent_uuid; uuid_copy(parent_uuid, zero_uuid);
+
+  if (!traverse(parent, parent_uuid, &parent_directory))
+    return -ENOENT;
+
+  // The name must fit a dirent_t
+  if (strlen(strrchr(path, '/') + 1) > MAX_FILE_NAME)
+    return -ENAMETOOLONG;
+
+  uuid_t uuid;
+  myfcb fcb = create_inode(parent_uuid, &parent_directory, strrchr(path, '/') + 1, is_directory, mode, uuid);
+
+  if (!uuid_is_null(parent_uuid))
+    myfs_dcache_put(dcache, parent, parent_uuid, &parent_directory);
+
+  myfs_dcache_put(dcache, path, uuid, &fcb);
+
+  return 0;
+}
+
+/*
+  Takes a reference to the handle of a file, making one if the file isn't open
+ */
+static myfs_handle_t *hold_handle(uuid_t uuid, myfcb *fcb)
+{
+  pthread_mutex_lock(&(handles->lock));
+
+  myfs_handle_t *handle = myfs_handles_get(handles, uuid);
+
+  if (!handle) {
+
+    handle = calloc(1, sizeof(myfs_handle_t));
+
+    uuid_copy(handle->uuid, uuid);
+    handle->fcb = *fcb;
+
+    pthread_rwlock_init(&(handle->lock), NULL);
+    pthread_mutex_init(&(handle->map_lock), NULL);
+
+    myfs_handle_invalidate(handle);
+    myfs_handles_add(handles, handle);
+  }
+
+  handle->refs++;
+
+  pthread_mutex_unlock(&(handles->lock));
+
+  return handle;
+}
+
+/*
+  Drops a reference to a handle. The last one takes it out of the index, and
+  the caller is left to free it once it is done with it.
+ */
+static bool drop_handle(myfs_handle_t *handle)
+{
+  pthread_mutex_lock(&(handles->lock));
+
+  bool last = --handle->refs == 0;
+
+  if (last)
+    myfs_handles_rem(handles, handle);
+
+  pthread_mutex_unlock(&(handles->lock));
+
+  return last;
+}
+
+static void free_handle(myfs_handle_t *handle)
+{
+  pthread_rwlock_destroy(&(handle->lock));
+  pthread_mutex_destroy(&(handle->map_lock));
+
+  free(handle->extents);
+  free(handle);
+}
+
+/*
+  Resolves the path once and stores a handle to the file in fi->fh
+ */
+static int open_handle(const char *path, struct fuse_file_info *fi)
+{
+  myfcb fcb = {0}; uuid_t uuid; uuid_copy(uuid, zero_uuid);
+
+  if (!traverse(path, uuid, &fcb))
+    return -ENOENT;
+
+  fi->fh = (uint64_t) hold_handle(uuid, &fcb);
+
+  return 0;
+}
+
+void fill_stbuf(struct stat *stbuf, myfcb *inode, ino_t number)
+{
+  stbuf->st_ino   = number;
+  stbuf->st_mode  = inode->mode;
+  stbuf->st_uid   = inode->uid;
+  stbuf->st_gid   = inode->gid;
+  stbuf->st_size  = inode->size;
+  stbuf->st_mtime = inode->mtime;
+  stbuf->st_ctime = inode->ctime;
+  stbuf->st_atime = inode->atime;
+}
+
+// The functions which follow are handler functions for various things a filesystem needs to do:
+// reading, getting attributes, truncating, etc. They will be called by FUSE whenever it needs
+// your filesystem to do something, so this is where functionality goes.
+
+// Get file and directory attributes (meta-data).
+// Read 'man 2 stat' and 'man 2 chmod'.
+static int myfs_getattr(const char *path, struct stat *stbuf)
+{
+  write_log("myfs_getattr(path=\"%s\", statbuf=0x%08x)\n", path, stbuf);
+  
+  memset(stbuf, 0, sizeof(struct stat));
+
+  myfcb current_directory = {0}; uuid_t uuid; uuid_copy(uuid, zero_uuid);
+
+  pthread_rwlock_rdlock(&fs_lock);
+  bool found = traverse(path, uuid, &current_directory);
+  pthread_rwlock_unlock(&fs_lock);
+
+  if (!found)
+    return -ENOENT;
+
+  fill_stbuf(stbuf, &current_directory, 10);
+  
+  return 0;
+}
+
+// Get the attributes of an open file, from its handle. A file unlinked
+// while it is open has no path, but still has its handle.
+static int myfs_fgetattr(const char *path, struct stat *stbuf, struct fuse_file_info *fi)
+{
+  write_log("myfs_fgetattr(path=\"%s\", statbuf=0x%08x, fi=0x%08x)\n", path, stbuf, fi);
+
+  myfs_handle_t *handle = (myfs_handle_t *) fi->fh;
+
+  memset(stbuf, 0, sizeof(struct stat));
+
+  pthread_rwlock_rdlock(&fs_lock);
+  pthread_rwlock_rdlock(&(handle->lock));
+
+  fill_stbuf(stbuf, &(handle->fcb), 10);
+
+  pthread_rwlock_unlock(&(handle->lock));
+  pthread_rwlock_unlock(&fs_lock);
+
+  return 0;
+}
+
+/*
+  Fetches the fcb of a directory entry, caching it under the entry's path so
+  that the getattr which usually follows a readdir needn't go to the store
+ */
+static void lookup_dirent(const char *directory_path, const char *name, uuid_t uuid, myfcb *fcb)
+{
+  char path[strlen(directory_path) + strlen(name) + 2];
+  sprintf(path, "%s/%s", strcmp(directory_path, "/") ? directory_path : "", name);
+
+  myfs_dentry_t dentry;
+
+  if (myfs_dcache_lookup(dcache, path, &dentry) && !dentry.negative) {
+
+    *fcb = dentry.fcb;
+
+  } else {
+
+    db_get_fcb(uuid, fcb);
+
+    myfs_dcache_put(dcache, path, uuid, fcb);
+  }
+
+  overlay_handle(uuid, fcb);
+}
+
+/*
+  Lists a directory from the given offset, see DIR_OFFSET
+ */
+static int read_directory(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset)
+{
+  myfcb current_directory = {0}; uuid_t uuid; uuid_copy(uuid, zero_uuid);
+
+  if (!traverse(path, uuid, &current_directory))
+    return -ENOENT;
+
+  if (offset < 1 && filler(buf, ".", NULL, 1))
+    return 0;
+
+  if (offset < 2 && filler(buf, "..", NULL, 2))
+    return 0;
+
+  if (!current_directory.size)
+    return 0;
+
+  // Resume past the first skip entries with this hash, and every entry with a lower one
+  uint32_t hash = 0;
+  int skip = 0;
+
+  if (offset >= DIR_OFFSET_BASE) {
+    hash = DIR_OFFSET_HASH(offset);
+    skip = DIR_OFFSET_COUNT(offset);
+  }
+
+  dir_header_t *header = dir_get_header(&current_directory);
+
+  bool full = false;
+
+  // Only one bucket is held in memory at a time
+  for (int b = dir_find_bucket(header, hash); b < header->buckets && !full; b++) {
+
+    unqlite_int64 size = 0;
+    unsigned char *data = dir_get_bucket(&current_directory, header->index[b].bucket, &size);
+
+    uint32_t run_hash = 0;
+    int run = 0;
+
+    for (unqlite_int64 position = 0; position < size && !full; ) {
+
+      packed_dirent_t *dirent = (packed_dirent_t *) (data + position);
+
+      position += PACKED_DIRENT_SIZE(dirent->length);
+
+      if (run == 0 || dirent->hash != run_hash) {
+	run_hash = dirent->hash;
+	run = 0;
+      }
+
+      run++;
+
+      if (dirent->hash < hash || (dirent->hash == hash && run <= skip))
+	continue;
+
+      char name[UINT8_MAX + 1];
+      memcpy(name, dirent->name, dirent->length);
+      name[dirent->length] = '\0';
+
+      myfcb fcb = {0};
+      lookup_dirent(path, name, dirent->uuid, &fcb);
+
+      struct stat stbuf = {0};
+      fill_stbuf(&stbuf, &fcb, 10);
+
+      full = filler(buf, name, &stbuf, DIR_OFFSET(dirent->hash, run));
+    }
+
+    free(data);
+  }
+
+  free(header);
+  
+  return 0;
+}
+
+// Read a directory.
+// Read 'man 2 readdir'.
+static int myfs_readdir(const char *path, void *buf, fuse_fill_dir_t filler, off_t offset, struct fuse_file_info *fi) {
+  write_log("write_readdir(path=\"%s\", buf=0x%08x, filler=0x%08x, offset=%lld, fi=0x%08x)\n", path, buf, filler, offset, fi);
+
+  pthread_rwlock_rdlock(&fs_lock);
+  int rc = read_directory(path, buf, filler, offset);
+  pthread_rwlock_unlock(&fs_lock);
+
+  return rc;
+}
+
+
+/*
+  Extents are kept sorted by logical block. Physical block n of a file is
+  stored under derive_key(file_data_id, n + 1), or of a flat file is block
+  n of the data file, and file_data_id itself holds the extent list once it
+  no longer fits in the fcb. The list is changed through the file's handle,
+  which keeps it in memory, so a file with many extents costs no more to
+  grow than one with a few. A list held in the fcb is kept up to date
+  there, one which has outgrown it is written back with the fcb.
+ */
+static unsigned char *extent_base(myfcb *fcb)
+{
+  return fcb->layout == LAYOUT_FLAT ? data_file_uuid : fcb->file_data_id;
+}
+
+static void extent_key(myfcb *fcb, uint64_t physical, uuid_t key)
+{
+  derive_key(extent_base(fcb), physical + 1, key);
+}
+
+/*
+  Fetches a copy of a file's extents, which the caller frees
+ */
+static extent_t *get_extents(myfcb *fcb)
+{
+  if (fcb->extent_count <= INLINE_EXTENTS) {
+
+    extent_t *extents = malloc(INLINE_EXTENTS * sizeof(extent_t));
+    memcpy(extents, fcb->extents, fcb->extent_count * sizeof(extent_t));
+
+    return extents;
+  }
+
+  unqlite_int64 size = 0;
+
+  return db_get_alloc(fcb->file_data_id, &size);
+}
+
+/*
+  The handle's copy of its file's extents, fetched the first time
+ */
+static extent_t *handle_extents(myfs_handle_t *handle)
+{
+  if (!handle->extents) {
+    handle->extents = get_extents(&(handle->fcb));
+    handle->extents_spilled = handle->fcb.extent_count > INLINE_EXTENTS;
+  }
+
+  return handle->extents;
+}
+
+/*
+  Records a change to the handle's extents. The fcb takes a list which fits
+  in it straight away, anything longer waits for put_handle_extents.
+ */
+static void set_handle_extents(myfs_handle_t *handle, extent_t *extents, uint32_t count)
+{
+  myfcb *fcb = &(handle->fcb);
+
+  if (count <= INLINE_EXTENTS)
+    memcpy(fcb->extents, extents, count * sizeof(extent_t));
+
+  fcb->extent_count = count;
+
+  handle->extents = extents;
+  handle->extents_dirty = true;
+}
+
+
+/*
+  The number of blocks mapped, up to the end of the last extent
+ */
+static uint32_t extents_end(extent_t *extents, uint32_t count)
+{
+  return count ? extents[count - 1].logical + extents[count - 1].length : 0;
+}
+
+/*
+  The index of the first extent which starts after the given block
+ */
+static uint32_t extent_search(extent_t *extents, uint32_t count, uint32_t block)
+{
+  uint32_t lo = 0, hi = count;
+
+  while (lo < hi) {
+
+    uint32_t mid = (lo + hi) / 2;
+
+    if (extents[mid].logical <= block)
+      lo = mid + 1;
+    else
+      hi = mid;
+  }
+
+  return lo;
+}
+
+/*
+  Maps blocks [from, to), which must lie in a hole, onto the physical
+  blocks starting at physical. Other than in a flat file each physical
+  block is allocated at its logical number, so the new run joins the
+  extents either side whenever it meets them, and a file written without
+  leaving holes is a single extent whatever order it was written in.
+  Nothing is stored here, the blocks are written by the caller.
+ */
+static void extents_map(myfs_handle_t *handle, uint32_t from, uint32_t to, uint64_t physical)
+{
+  extent_t *extents = handle_extents(handle);
+  uint32_t count = handle->fcb.extent_count;
+
+  uint32_t pos = extent_search(extents, count, from);
+
+  extent_t *prev = pos ? &(extents[pos - 1]) : NULL;
+  extent_t *next = pos < count ? &(extents[pos]) : NULL;
+
+  bool join_prev = prev && prev->logical + prev->length == from && prev->physical + prev->length == physical;
+  bool join_next = next && next->logical == to && next->physical == physical + (to - from);
+
+  if (join_prev && join_next) {
+
+    prev->length += (to - from) + next->length;
+
+    memmove(next, next + 1, (count - pos - 1) * sizeof(extent_t));
+    count--;
+
+  } else if (join_prev) {
+
+    prev->length += to - from;
+
+  } else if (join_next) {
+
+    next->length += to - from;
+    next->logical = from;
+    next->physical = physical;
+
+  } else {
+
+    extents = realloc(extents, (count + 1) * sizeof(extent_t));
+
+    memmove(&(extents[pos + 1]), &(extents[pos]), (count - pos) * sizeof(extent_t));
+    extents[pos] = (extent_t) { from, to - from, physical };
+    count++;
+  }
+
+  set_handle_extents(handle, extents, count);
+}
+
+/*
+  Unmaps every block from the given one onwards, queueing their data on the reaper
+ */
+static void extents_shrink(myfs_handle_t *handle, uint32_t to, myfs_reaper_t *reaper)
+{
+  myfcb *fcb = &(handle->fcb);
+
+  extent_t *extents = handle_extents(handle);
+  uint32_t count = fcb->extent_count;
+
+  while (count && extents_end(extents, count) > to) {
+
+    extent_t *last = &(extents[count - 1]);
+
+    uint32_t keep = last->logical < to ? to - last->logical : 0;
+
+    // The keys of an extent are consecutive, see extent_key
+    myfs_reaper_add(reaper, extent_base(fcb), last->physical + keep + 1, last->length - keep);
+
+    if (keep)
+      last->length = keep;
+    else
+      count--;
+  }
+
+  set_handle_extents(handle, extents, count);
+}
+
+/*
+  Resolves a run of blocks through a file's extents. Blocks which fall
+  between extents resolve to the null uuid.
+ */
+static void map_extents(myfcb *fcb, extent_t *extents, uint32_t first, int count, uuid_t *uuids)
+{
+  // The last extent starting at or before the first block
+  int e = (int) extent_search(extents, fcb->extent_count, first) - 1;
+
+  while (count) {
+
+    uint32_t n;
+
+    if (e >= 0 && first < extents[e].logical + extents[e].length) {
+
+      n = extents[e].logical + extents[e].length - first;
+      n = n < count ? n : count;
+
+      for (uint32_t k = 0; k < n; k++)
+	extent_key(fcb, extents[e].physical + (first - extents[e].logical) + k, uuids[k]);
+
+    } else {
+
+      // A hole, up to the next extent
+      n = e + 1 < (int) fcb->extent_count ? extents[e + 1].logical - first : count;
+      n = n < count ? n : count;
+
+      for (uint32_t k = 0; k < n; k++)
+	uuid_clear(uuids[k]);
+    }
+
+    first += n;
+    uuids += n;
+    count -= n;
+
+    if (e + 1 < (int) fcb->extent_count && first >= extents[e + 1].logical)
+      e++;
+  }
+}
+
+/*
+  The base the keys of a keyed or log file's blocks are derived from. A log
+  file's is its file_data_id marked with LOG_KEY_MARK.
+ */
+static void keyed_base(myfcb *fcb, uuid_t base)
+{
+  uuid_copy(base, fcb->file_data_id);
+
+  if (fcb->layout == LAYOUT_LOG)
+    base[6] = LOG_KEY_MARK | (base[6] & 0x0f);
+}
+
+/*
+  Resolves a run of blocks of a keyed or log file. Every block has its key,
+  for a keyed file the same one the extent layout would give physical
+  block n, whether or not anything was ever stored under it.
+ */
+static void map_keyed(myfcb *fcb, uint32_t first, int count, uuid_t *uuids)
+{
+  uuid_t base;
+  keyed_base(fcb, base);
+
+  for (int k = 0; k < count; k++)
+    derive_key(base, (uint64_t) first + k + 1, uuids[k]);
+}
+
+/*
+  Queues the blocks of a keyed or log file from the given one onwards. Only
+  those up to the furthest the file was ever written can have a record, so
+  a sparse file cut short doesn't queue a key for every hole up to its end.
+ */
+static void keyed_shrink(myfcb *fcb, uint64_t from, myfs_reaper_t *reaper)
+{
+  uuid_t base;
+  keyed_base(fcb, base);
+
+  if (from < fcb->keyed_blocks) {
+    myfs_reaper_add(reaper, base, from + 1, fcb->keyed_blocks - from);
+    fcb->keyed_blocks = from;
+  }
+}
+
+/*
+  Fetches an indirect block. One which was never allocated maps nothing but holes
+ */
+static void get_indirect_block(uuid_t uuid, indirect_block_t *indirect_block)
+{
+  if (uuid_is_null(uuid))
+    memset(indirect_block, 0, sizeof(indirect_block_t));
+  else
+    db_get_block(uuid, indirect_block, sizeof(indirect_block_t));
+}
+
+static void put_indirect_block(uuid_t uuid, indirect_block_t *indirect_block)
+{
+  if (!uuid_is_null(uuid))
+    db_put_block(uuid, indirect_block, sizeof(indirect_block_t));
+}
+
+/*
+  Resolves the uuids of count consecutive data blocks, starting at first,
+  into uuids. The map is walked a run at a time: each indirect block that
+  covers the range is looked at once (through the copies kept in the
+  handle) and its part of the run copied out whole.
+ */
+static void map_blocks(myfs_handle_t *handle, uint32_t first, int count, uuid_t *uuids)
+{
+  myfcb *fcb = &(handle->fcb);
+
+  if (fcb->layout == LAYOUT_KEYED || fcb->layout == LAYOUT_LOG) {
+
+    map_keyed(fcb, first, count, uuids);
+    return;
+  }
+
+  if (fcb->layout == LAYOUT_EXTENTS || fcb->layout == LAYOUT_FLAT) {
+
+    if (fcb->extent_count <= INLINE_EXTENTS) {
+
+      map_extents(fcb, fcb->extents, first, count, uuids);
+
+    } else {
+
+      map_extents(fcb, handle_extents(handle), first, count, uuids);
+    }
+
+    return;
+  }
+
+  while (count) {
+
+    int n;
+
+    if (first < 13) {
+
+      n = 13 - first;
+      n = n < count ? n : count;
+
+      memcpy(uuids, fcb->direct_blocks[first], n * sizeof(uuid_t));
+    
+    } else if (first < 256 + 13) {
+
+      if (!handle->singley_cached) {
+
+	get_indirect_block(fcb->singley_indirect_blocks, &(handle->singley));
+	handle->singley_cached = true;
+      }
+
+      n = 256 + 13 - first;
+      n = n < count ? n : count;
+
+      memcpy(uuids, handle->singley.uuid[first - 13], n * sizeof(uuid_t));
+    
+    } else if (first < 256 * 256 + 256 + 13) {
+
+      int index = first - 13 - 256;
+
+      int fst_index = index / 256;
+      int snd_index = index % 256;
+
+      if (!handle->doubley_cached) {
+
+	get_indirect_block(fcb->doubley_indirect_blocks, &(handle->doubley));
+	handle->doubley_cached = true;
+	handle->doubley_index = -1;
+      }
+
+      if (handle->doubley_index != fst_index) {
+
+	get_indirect_block(handle->doubley.uuid[fst_index], &(handle->doubley_s));
+	handle->doubley_index = fst_index;
+      }
+
+      n = 256 - snd_index;
+      n = n < count ? n : count;
+
+      memcpy(uuids, handle->doubley_s.uuid[snd_index], n * sizeof(uuid_t));
+
+    } else {
+
+      int index = first - 13 - 256 - 256 * 256;
+
+      int leaf_index = index / 256;
+      int trd_index = index % 256;
+
+      // Only the leaf is kept, the blocks above it are walked when it changes
+      if (handle->tripley_index != leaf_index) {
+
+	indirect_block_t indirect_block_f, indirect_block_s;
+
+	get_indirect_block(fcb->tripley_indirect_blocks, &indirect_block_f);
+	get_indirect_block(indirect_block_f.uuid[leaf_index / 256], &indirect_block_s);
+	get_indirect_block(indirect_block_s.uuid[leaf_index % 256], &(handle->tripley_s));
+
+	handle->tripley_index = leaf_index;
+      }
+
+      n = 256 - trd_index;
+      n = n < count ? n : count;
+
+      memcpy(uuids, handle->tripley_s.uuid[trd_index], n * sizeof(uuid_t));
+    }
+
+    first += n;
+    uuids += n;
+    count -= n;
+  }
+  
+}
+
+/*
+  Queues a block, or an indirect block of the given depth along with
+  everything under it from the first index onwards. The uuid is cleared if
+  the whole of it goes, otherwise the indirect block is written back without
+  the entries which were freed. Each indirect block is read just once.
+ */
+static void reclaim_tree(uuid_t uuid, int depth, uint64_t first, myfs_reaper_t *reaper)
+{
+  // Nothing was ever stored for a hole
+  if (uuid_is_null(uuid))
+    return;
+
+  if (depth) {
+
+    uint64_t span = 1ULL << (8 * (depth - 1));
+
+    indirect_block_t indirect_block;
+    get_indirect_block(uuid, &indirect_block);
+
+    for (uint64_t i = first / span; i < 256; i++)
+      reclaim_tree(indirect_block.uuid[i], depth - 1, i == first / span ? first % span : 0, reaper);
+
+    if (first) {
+      put_indirect_block(uuid, &indirect_block);
+      return;
+    }
+  }
+
+  myfs_reaper_add(reaper, uuid, 0, 1);
+  uuid_clear(uuid);
+}
+
+/*
+  Unmaps every block of a block mapped file from the given one onwards
+ */
+static void blockmap_shrink(myfcb *fcb, uint64_t from, myfs_reaper_t *reaper)
+{
+  for (uint64_t i = from; i < 13; i++)
+    reclaim_tree(fcb->direct_blocks[i], 0, 0, reaper);
+
+  uuid_t *roots[] = { &(fcb->singley_indirect_blocks), &(fcb->doubley_indirect_blocks), &(fcb->tripley_indirect_blocks) };
+
+  uint64_t base = 13;
+
+  for (int depth = 1; depth <= 3; depth++) {
+
+    uint64_t span = 1ULL << (8 * depth);
+
+    if (from < base + span)
+      reclaim_tree(*roots[depth - 1], depth, from > base ? from - base : 0, reaper);
+
+    base += span;
+  }
+}
+
+static void initialize_block(uuid_t uuid_to_indirect_block)
+{
+  uuid_generate_random(uuid_to_indirect_block);
+  db_put_block(uuid_to_indirect_block, &empty_indirect_block, sizeof(indirect_block_t));
+}
+
+static void add_direct_block(myfcb *fcb, uint32_t index)
+{
+  initialize_block(fcb->direct_blocks[index]);
+}
+
+static void add_singley_indirect_block(uuid_t uuid_of_fcb, myfcb *fcb, uint32_t index)
+{
+  indirect_block_t indirect_block_f = {0};
+
+  index = index - 13;
+
+  // Initialize singley indirect block
+  if (uuid_is_null(fcb->singley_indirect_blocks))
+    initialize_block(fcb->singley_indirect_blocks);
+
+  get_indirect_block(fcb->singley_indirect_blocks, &indirect_block_f);
+
+  initialize_block(indirect_block_f.uuid[index]);
+
+
+  db_put_block(fcb->singley_indirect_blocks, &indirect_block_f, sizeof(indirect_block_t));
+}
+
+static void add_doubley_indirect_block(uuid_t uuid_of_fcb, myfcb *fcb, uint32_t index)
+{
+  indirect_block_t indirect_block_f = {0};
+  indirect_block_t indirect_block_s = {0};
+
+  index = index - 13 - 256;
+
+  int fst_index = index / 256;
+  int snd_index = index % 256;
+
+  // Initialize doubley indirect block
+  if (uuid_is_null(fcb->doubley_indirect_blocks))
+    initialize_block(fcb->doubley_indirect_blocks);
+
+  get_indirect_block(fcb->doubley_indirect_blocks, &indirect_block_f);
+
+  if (uuid_is_null(indirect_block_f.uuid[fst_index]))
+    initialize_block(indirect_block_f.uuid[fst_index]);
+
+  get_indirect_block(indirect_block_f.uuid[fst_index], &indirect_block_s);
+
+  initialize_block(indirect_block_s.uuid[snd_index]);
+
+  db_put_block(fcb->doubley_indirect_blocks, &indirect_block_f, sizeof(indirect_block_t));
+  db_put_block(indirect_block_f.uuid[fst_index], &indirect_block_s, sizeof(indirect_block_t));
+  
+}
+
+static void add_tripley_indirect_block(uuid_t uuid_of_fcb, myfcb *fcb, uint32_t index)
+{
+  indirect_block_t indirect_block_f = {0};
+  indirect_block_t indirect_block_s = {0};
+  indirect_block_t indirect_block_leaf = {0};
+
+  index = index - 13 - 256 - 256 * 256;
+
+  int fst_index = index / (256 * 256);
+  int snd_index = (index / 256) % 256;
+  int trd_index = index % 256;
+
+  // Initialize tripley indirect block
+  if (uuid_is_null(fcb->tripley_indirect_blocks))
+    initialize_block(fcb->tripley_indirect_blocks);
+
+  get_indirect_block(fcb->tripley_indirect_blocks, &indirect_block_f);
+
+  if (uuid_is_null(indirect_block_f.uuid[fst_index]))
+    initialize_block(indirect_block_f.uuid[fst_index]);
+
+  get_indirect_block(indirect_block_f.uuid[fst_index], &indirect_block_s);
+
+  if (uuid_is_null(indirect_block_s.uuid[snd_index]))
+    initialize_block(indirect_block_s.uuid[snd_index]);
+
+  get_indirect_block(indirect_block_s.uuid[snd_index], &indirect_block_leaf);
+
+  initialize_block(indirect_block_leaf.uuid[trd_index]);
+
+  db_put_block(fcb->tripley_indirect_blocks, &indirect_block_f, sizeof(indirect_block_t));
+  db_put_block(indirect_block_f.uuid[fst_index], &indirect_block_s, sizeof(indirect_block_t));
+  db_put_block(indirect_block_s.uuid[snd_index], &indirect_block_leaf, sizeof(indirect_block_t));
+  
+}
+
+static void add_block(uuid_t uuid_of_fcb, myfcb *fcb, uint32_t index)
+{
+
+  if (index < 13) {
+
+    add_direct_block(fcb, index);
+
+  } else if (index < 256 + 13) {
+
+    add_singley_indirect_block(uuid_of_fcb, fcb, index);
+    
+  } else if (index < 256 + 13 + 256 * 256) {
+
+    add_doubley_indirect_block(uuid_of_fcb, fcb, index);
+    
+  } else if (index < BLOCKMAP_MAX_BLOCKS) {
+
+    add_tripley_indirect_block(uuid_of_fcb, fcb, index);
+
+  }
+
+}
+
+static void set_block(uuid_t uuid_to_block, block_t *block)
+{
+  db_put_block(uuid_to_block, block, sizeof(block_t));
+}
+
+/*
+  Reads a block, returning whether it was ever written. A block which was
+  never mapped, or a block of a keyed file which has no record, reads as
+  zeros.
+ */
+static bool get_block(uuid_t uuid_to_block, block_t *block)
+{
+  if (!uuid_is_null(uuid_to_block) && db_get_block(uuid_to_block, block, sizeof(block_t)) == UNQLITE_OK)
+    return true;
+
+  memset(block, 0, sizeof(block_t));
+
+  return false;
+}
+
+/*
+  Reads size bytes of a block from offset into buf. A block of the data
+  file is copied from the mapping, unless the block cache has it, which
+  may be newer than the file.
+ */
+static void read_block(uuid_t uuid_to_block, char *buf, size_t offset, size_t size)
+{
+  const char *mapped = data_map_block(uuid_to_block);
+
+  if (mapped) {
+
+    if (!cache_peek(cache, uuid_to_block, buf, offset, size)) {
+      memcpy(buf, mapped + offset, size);
+      __atomic_add_fetch(&data_map_reads, 1, __ATOMIC_RELAXED);
+    }
+
+    return;
+  }
+
+  if (size == BLOCK_SIZE) {
+
+    // Whole blocks are read straight into the caller's buffer
+    get_block(uuid_to_block, (block_t *) buf);
+
+  } else {
+
+    block_t block;
+
+    get_block(uuid_to_block, &block);
+
+    memcpy(buf, ((char *) (&block)) + offset, size);
+  }
+}
+
+
+/*
+  The largest size the layout of a file can map
+ */
+static off_t max_file_size(myfcb *fcb)
+{
+  if (fcb->layout == LAYOUT_EXTENTS || fcb->layout == LAYOUT_FLAT)
+    return EXTENTS_MAX_BLOCKS * BLOCK_SIZE;
+
+  if (fcb->layout == LAYOUT_KEYED || fcb->layout == LAYOUT_LOG)
+    return KEYED_MAX_BLOCKS * BLOCK_SIZE;
+
+  return (off_t) BLOCKMAP_MAX_BLOCKS * BLOCK_SIZE;
+}
+
+/*
+  Zeroes the end of the block a file now ends part way through, so that the
+  bytes cut off don't reappear if the file grows again
+ */
+static void zero_tail(myfs_handle_t *handle, size_t newsize)
+{
+  uuid_t uuid_to_block;
+  map_blocks(handle, size_to_block(newsize), 1, &uuid_to_block);
+
+  block_t block;
+
+  // A hole has nothing to cut off
+  if (!get_block(uuid_to_block, &block))
+    return;
+
+  memset(((char *) &block) + newsize % BLOCK_SIZE, 0, BLOCK_SIZE - newsize % BLOCK_SIZE);
+
+  set_block(uuid_to_block, &block);
+}
+
+/*
+  Unmaps the blocks of a file from the given one onwards
+ */
+static void shrink_blocks(myfs_handle_t *handle, uint64_t from, myfs_reaper_t *reaper)
+{
+  myfcb *fcb = &(handle->fcb);
+
+  if (fcb->layout == LAYOUT_EXTENTS || fcb->layout == LAYOUT_FLAT)
+    extents_shrink(handle, from, reaper);
+  else if (fcb->layout == LAYOUT_KEYED || fcb->layout == LAYOUT_LOG)
+    keyed_shrink(fcb, from, reaper);
+  else
+    blockmap_shrink(fcb, from, reaper);
+}
+
+static int _internal_resize_(myfs_handle_t *handle, size_t newsize)
+{
+  myfcb *fcb = &(handle->fcb);
+
+  if (newsize < fcb->size) {
+
+    if (newsize % BLOCK_SIZE)
+      zero_tail(handle, newsize);
+
+    // The file may map the same keys again as it grows, so they go right
+    // away. Only blocks the file had mapped or written are queued.
+    myfs_reaper_t cut = {0};
+
+    shrink_blocks(handle, (newsize + BLOCK_SIZE - 1) / BLOCK_SIZE, &cut);
+    reaper_run(&cut, UINT64_MAX);
+
+    myfs_handle_invalidate(handle);
+  }
+
+  // Growing leaves a hole, blocks are only given out as they are written
+  fcb->size = newsize;
+
+  return 0;
+}
+
+/*
+  Unmaps every block of a file which has been removed. The blocks are left
+  to the background thread to delete.
+ */
+static void reclaim_file(myfs_handle_t *handle)
+{
+  myfs_reaper_t removed = {0};
+
+  shrink_blocks(handle, 0, &removed);
+
+  // Drops the record of a list of extents which had outgrown the fcb
+  put_handle_extents(handle);
+
+  handle->fcb.size = 0;
+
+  pthread_mutex_lock(&reaper_lock);
+  myfs_reaper_splice(&reaper, &removed);
+  pthread_mutex_unlock(&reaper_lock);
+
+  pthread_mutex_lock(&background_lock);
+  pthread_cond_signal(&background_wake);
+  pthread_mutex_unlock(&background_lock);
+}
+
+/*
+  Where in the data file a run of a flat file starting at the given block
+  is best put: straight after the block mapping the one before it, or where
+  the allocator last left off (ALLOC_NO_GOAL) if there is none.
+ */
+static uint64_t flat_goal(myfs_handle_t *handle, uint32_t from)
+{
+  extent_t *extents = handle_extents(handle);
+
+  uint32_t pos = extent_search(extents, handle->fcb.extent_count, from);
+
+  return pos ? extents[pos - 1].physical + (from - extents[pos - 1].logical) : ALLOC_NO_GOAL;
+}
+
+/*
+  Maps blocks [from, to) of a flat file onto as few runs of the data file as
+  the allocator can find. Returns how many were mapped, which falls short
+  of the whole range if the data file can't grow.
+ */
+static uint32_t flat_map(myfs_handle_t *handle, uint32_t from, uint32_t to)
+{
+  uint32_t start = from;
+
+  while (from < to) {
+
+    uint64_t goal = flat_goal(handle, from), got;
+
+    pthread_mutex_lock(&alloc_lock);
+
+    uint64_t physical = myfs_alloc_run(&allocator, goal, to - from, &got);
+
+    if (data_reserve(physical + got) != 0) {
+
+      // The data file can't grow, but blocks freed within it can still be used
+      myfs_alloc_return(&allocator, physical, got);
+
+      physical = myfs_alloc_run(&allocator, 0, to - from, &got);
+
+      uint64_t fits = physical < data_file_blocks ? data_file_blocks - physical : 0;
+
+      if (got > fits) {
+	myfs_alloc_return(&allocator, physical + fits, got - fits);
+	got = fits;
+      }
+    }
+
+    pthread_mutex_unlock(&alloc_lock);
+
+    if (!got)
+      break;
+
+    extents_map(handle, from, from + got, physical);
+
+    from += got;
+  }
+
+  return from - start;
+}
+
+/*
+  Gives blocks to a run of a file which is a hole, and resolves their uuids.
+  A keyed or log file never has a hole to fill, its blocks all map to
+  their keys. Returns how many of the run were given blocks, only a flat
+  file can get fewer than it asked for.
+ */
+static int alloc_blocks(myfs_handle_t *handle, uint32_t first, int count, uuid_t *uuids)
+{
+  myfcb *fcb = &(handle->fcb);
+
+  if (fcb->layout == LAYOUT_EXTENTS)
+    extents_map(handle, first, first + count, first);
+  else if (fcb->layout == LAYOUT_FLAT)
+    count = flat_map(handle, first, first + count);
+  else
+    for (uint32_t i = first; i < first + count; i++)
+      add_block(handle->uuid, fcb, i);
+
+  // The block map has changed under the copies in the handle
+  myfs_handle_invalidate(handle);
+  handle->dirty = true;
+
+  map_blocks(handle, first, count, uuids);
+
+  return count;
+}
+
+/*
+  Writes bytes from start, giving blocks to the holes written into. Returns
+  how many bytes were written, fewer than asked for if the data file ran
+  out of room for a flat file.
+ */
+static int _internal_put_(myfs_handle_t *handle, const char *buf, size_t bytes, off_t start)
+{
+
+  block_t block;
+
+  uuid_t uuids[MAP_BATCH];
+  int j = 0, mapped = 0, fresh = 0, written = 0;
+
+  uint32_t i = size_to_block(start); // block to start with
+  
+  while(bytes) {
+
+    size_t s = start % (BLOCK_SIZE);
+    size_t r = (BLOCK_SIZE - s);
+    size_t l = bytes < r ? bytes : r;
+
+    // Resolve the next run of blocks
+    if (j == mapped) {
+
+      size_t remaining = (s + bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+      mapped = remaining < MAP_BATCH ? remaining : MAP_BATCH;
+      map_blocks(handle, i, mapped, uuids);
+
+      j = 0;
+    }
+
+    // Holes are only given blocks once they are written, the whole run at once
+    if (uuid_is_null(uuids[j])) {
+
+      int n = 1;
+
+      while (j + n < mapped && uuid_is_null(uuids[j + n]))
+	n++;
+
+      fresh = alloc_blocks(handle, i, n, uuids + j);
+
+      if (!fresh)
+	break;
+    }
+
+    start = 0;
+
+    if (l == BLOCK_SIZE) {
+
+      // The whole block is overwritten, so there is nothing to read first
+      set_block(uuids[j], (block_t *) buf);
+
+    } else {
+
+      memset(&block, 0, sizeof(block_t));
+
+      // A block which was a hole reads as zeros, whatever a block of the
+      // data file held before it was freed and handed out again
+      if (!fresh)
+	get_block(uuids[j], &block);
+
+      char *dst = ((char *) (&block)) + s;
+    
+      memcpy(dst, buf, l);
+
+      set_block(uuids[j], &block);
+    }
+
+    bytes -= l;
+    buf   += l;
+
+    written += l;
+
+    if (fresh)
+      fresh--;
+    
+    i++;
+    j++;
+  }
+
+  // A keyed file has nothing else recording which of its blocks were written
+  if ((handle->fcb.layout == LAYOUT_KEYED || handle->fcb.layout == LAYOUT_LOG) && written && i > handle->fcb.keyed_blocks) {
+    handle->fcb.keyed_blocks = i;
+    handle->dirty = true;
+  }
+  
+  return written;
+}
+
+static int _internal_get_(myfs_handle_t *handle, char *buf, size_t bytes, off_t start)
+{
+
+  uuid_t uuids[MAP_BATCH];
+  int j = 0, mapped = 0;
+
+  uint32_t i = size_to_block(start); // block to start with
+  
+  while(bytes) {
+
+    size_t s = start % (BLOCK_SIZE);
+    size_t r = (BLOCK_SIZE - s);
+    size_t l = bytes < r ? bytes : r;
+
+    // Resolve the next run of blocks
+    if (j == mapped) {
+
+      size_t remaining = (s + bytes + BLOCK_SIZE - 1) / BLOCK_SIZE;
+
+      mapped = remaining < MAP_BATCH ? remaining : MAP_BATCH;
+
+      // Other readers may be filling in the same copies of the block map
+      pthread_mutex_lock(&(handle->map_lock));
+      map_blocks(handle, i, mapped, uuids);
+      pthread_mutex_unlock(&(handle->map_lock));
+
+      if (mapped > 1)
+	data_map_advise(uuids, mapped);
+
+      j = 0;
+    }
+
+    start = 0;
+
+    read_block(uuids[j], buf, s, l);
+
+    bytes -= l;
+    buf   += l;
+    
+    i++;
+    j++;
+  }
+  
+  return 0;
+}
+
+
+// Read a file.
+// Read 'man 2 read'.
+static int myfs_read(const char *path, char *buf, size_t size, off_t offset, struct fuse_file_info *fi){
+  write_log("myfs_read(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n", path, buf, size, offset, fi);
+
+  myfs_handle_t *handle = (myfs_handle_t *) fi->fh;
+
+  size_t corrected_size = 0;
+
+  pthread_rwlock_rdlock(&fs_lock);
+  pthread_rwlock_rdlock(&(handle->lock));
+
+  if (offset < handle->fcb.size) {
+
+    corrected_size = handle->fcb.size - offset < size ? handle->fcb.size - offset : size;
+
+    _internal_get_(handle, buf, corrected_size, offset);
+  }
+
+  pthread_rwlock_unlock(&(handle->lock));
+  pthread_rwlock_unlock(&fs_lock);
+    
+  return corrected_size;
+}
+
+// This file system only supports one file. Create should fail if a file has been created. Path must be '/<something>'.
+// Read 'man 2 creat'.
+static int myfs_create(const char *path, mode_t mode, struct fuse_file_info *fi){   
+  write_log("myfs_create(path=\"%s\", mode=0%03o, fi=0x%08x)\n", path, mode, fi);
+
+  pthread_rwlock_wrlock(&fs_lock);
+
+  int rc = mk_inode(path, false, mode);
+
+  if (!rc)
+    rc = open_handle(path, fi);
+
+  pthread_rwlock_unlock(&fs_lock);
+
+  return rc;
+}
+
+// Set update the times (actime, modtime) for a file. This FS only supports modtime.
+// Read 'man 2 utime'.
+static int myfs_utime(const char *path, struct utimbuf *ubuf){
+  write_log("myfs_utime(path=\"%s\", ubuf=0x%08x)\n", path, ubuf);
+
+  myfcb fcb = {0}; uuid_t uuid; uuid_copy(uuid, zero_uuid);
+
+  int rc = -ENOENT;
+
+  pthread_rwlock_wrlock(&fs_lock);
+
+  if( traverse(path, uuid, &fcb) ) {
+    
+    fcb.atime = ubuf->actime;
+    fcb.mtime = ubuf->modtime;
+
+    update_fcb(path, uuid, &fcb);
+    
+    rc = 0;
+  }
+
+  pthread_rwlock_unlock(&fs_lock);
+  
+  return rc;
+}
+
+// Write to a file.
+// Read 'man 2 write'
+static int myfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi){   
+  write_log("myfs_write(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n", path, buf, size, offset, fi);
+
+  myfs_handle_t *handle = (myfs_handle_t *) fi->fh;
+
+  int rc = size;
+
+  pthread_rwlock_rdlock(&fs_lock);
+  pthread_rwlock_wrlock(&(handle->lock));
+
+  if (offset + size > max_file_size(&(handle->fcb))) {
+
+    rc = -EFBIG;
+
+  } else {
+
+    size_t old_size = handle->fcb.size;
+
+    if (handle->fcb.size < offset + size) {
+
+      _internal_resize_(handle, offset + size);
+
+      handle->dirty = true;
+    }
+
+    int written = _internal_put_(handle, buf, size, offset);
+
+    if ((size_t) written < size) {
+
+      // The data file is full. The file only grows as far as was written.
+      size_t end = offset + written > old_size ? offset + written : old_size;
 
-    _internal_get_(&fcb, buf, corrected_size, offset);
+      if (handle->fcb.size > end)
+	_internal_resize_(handle, end);
+
+      rc = written ? written : -ENOSPC;
+    }
+  }
+
+  pthread_rwlock_unlock(&(handle->lock));
+  pthread_rwlock_unlock(&fs_lock);
     
-    return corrected_size;
+  return rc;
+}
+
+/*
+  Resizes a file through its handle, whose lock the caller holds. The fcb of
+  a file which was unlinked while it is open is never written back.
+ */
+static void resize_handle(const char *path, myfs_handle_t *handle, off_t newsize)
+{
+  _internal_resize_(handle, newsize);
+
+  if (!handle->unlinked)
+    write_handle_fcb(path, handle);
+}
+
+// Set the size of a file.
+// Read 'man 2 truncate'.
+int myfs_truncate(const char *path, off_t newsize){    
+  write_log("myfs_truncate(path=\"%s\", newsize=%lld)\n", path, newsize);
+
+  myfcb fcb = {0}; uuid_t uuid; uuid_copy(uuid, zero_uuid);
+
+  int rc = -ENOENT;
+
+  pthread_rwlock_rdlock(&fs_lock);
+
+  if( traverse(path, uuid, &fcb) ) {
+
+    rc = -EFBIG;
+
+    if (newsize <= max_file_size(&fcb)) {
+
+      // The file is resized through its handle, which an open file already
+      // has with its latest extents, and which keeps reads and writes out
+      myfs_handle_t *handle = hold_handle(uuid, &fcb);
+
+      pthread_rwlock_wrlock(&(handle->lock));
+      resize_handle(path, handle, newsize);
+      pthread_rwlock_unlock(&(handle->lock));
+
+      if (drop_handle(handle))
+	free_handle(handle);
+
+      rc = 0;
+    }
   } 
+
+  pthread_rwlock_unlock(&fs_lock);
   
-  return -ENOENT;
+  return rc;
 }
 
-// This file system only supports one file. Create should fail if a file has been created. Path must be '/<something>'.
-// Read 'man 2 creat'.
-static int myfs_create(const char *path, mode_t mode, struct fuse_file_info *fi){   
-  write_log("myfs_create(path=\"%s\", mode=0%03o, fi=0x%08x)\n", path, mode, fi);
+// Set the size of an open file, through its handle, which a file unlinked
+// while it is open still has.
+// Read 'man 2 ftruncate'.
+static int myfs_ftruncate(const char *path, off_t newsize, struct fuse_file_info *fi){
+  write_log("myfs_ftruncate(path=\"%s\", newsize=%lld, fi=0x%08x)\n", path, newsize, fi);
+
+  myfs_handle_t *handle = (myfs_handle_t *) fi->fh;
+
+  int rc = -EFBIG;
+
+  pthread_rwlock_rdlock(&fs_lock);
+  pthread_rwlock_wrlock(&(handle->lock));
+
+  if (newsize <= max_file_size(&(handle->fcb))) {
+    resize_handle(path, handle, newsize);
+    rc = 0;
+  }
+
+  pthread_rwlock_unlock(&(handle->lock));
+  pthread_rwlock_unlock(&fs_lock);
+
+  return rc;
+}
+
+// Set permissions.
+// Read 'man 2 chmod'.
+int myfs_chmod(const char *path, mode_t mode){
+  write_log("myfs_chmod(fpath=\"%s\", mode=0%03o)\n", path, mode);
+
+  myfcb fcb = {0}; uuid_t uuid; uuid_copy(uuid, zero_uuid);
+
+  int rc = -ENOENT;
+
+  pthread_rwlock_wrlock(&fs_lock);
+
+  if( traverse(path, uuid, &fcb) ) {
+    
+    fcb.mode = mode;
+
+    update_fcb(path, uuid, &fcb);
+    
+    rc = 0;
+  }
+
+  pthread_rwlock_unlock(&fs_lock);
+    
+  return rc;
+}
+
+// Set ownership.
+// Read 'man 2 chown'.
+int myfs_chown(const char *path, uid_t uid, gid_t gid){   
+  write_log("myfs_chown(path=\"%s\", uid=%d, gid=%d)\n", path, uid, gid);
+
+  myfcb fcb = {0}; uuid_t uuid; uuid_copy(uuid, zero_uuid);
+
+  int rc = -ENOENT;
+
+  pthread_rwlock_wrlock(&fs_lock);
+
+  if( traverse(path, uuid, &fcb) ) {
+    
+    fcb.uid = uid;
+    fcb.gid = gid;
+
+    update_fcb(path, uuid, &fcb);
+    
+    rc = 0;
+  }
+
+  pthread_rwlock_unlock(&fs_lock);
+   
+  return rc;
+}
+
+// Create a directory.
+// Read 'man 2 mkdir'.
+static int myfs_mkdir(const char *path, mode_t mode)
+{
+  write_log("myfs_mkdir(path=\"%s\", mode=0%03o)\n", path, mode);
+
+  pthread_rwlock_wrlock(&fs_lock);
+  int rc = mk_inode(path, true, mode);
+  pthread_rwlock_unlock(&fs_lock);
+
+  return rc;
+}
+
+
+bool rm_dirent(uuid_t parent_uuid, myfcb *directory, char *file)
+{
+  dirent_t dirent = {0};
+
+  if (!directory->size || !dir_remove(directory, file, &dirent))
+    return false;
+
+  directory->size--;
+
+  myfcb fcb = {0};
+
+  db_get_fcb(dirent.uuid, &fcb);
+
+  myfs_handle_t *handle = myfs_handles_get(handles, dirent.uuid);
+
+  if (handle) {
+
+    // Still open, the last release reclaims it
+    handle->unlinked = true;
+
+  } else {
+
+    if (S_ISDIR(fcb.mode)) {
+
+      dir_free(&fcb);
+
+    } else {
+
+      myfs_handle_t closed = {0};
+
+      closed.fcb = fcb;
+      myfs_handle_invalidate(&closed);
+
+      reclaim_file(&closed);
+
+      free(closed.extents);
+    }
+
+    db_rem(dirent.uuid);
+  }
+
+  return true;
+}
+
+// Delete a file.
+// Read 'man 2 unlink'.
+int myfs_unlink(const char *path){
+  write_log("myfs_unlink: %s\n",path);
+
+  char parent[strlen(path) + 1]; strcpy(parent, path); ascend_path(parent);
+
+  char copy_of_path[strlen(path) + 1]; strcpy(copy_of_path, path);
+
+  char *p = copy_of_path; char *s = NULL;
+
+  while(!split_path(&p, &s))
+    ;
+
+  myfcb fcb = {0}; uuid_t uuid; uuid_copy(uuid, zero_uuid);
+
+  int rc = -ENOENT;
+
+  pthread_rwlock_wrlock(&fs_lock);
+
+  if (traverse(parent, uuid, &fcb) && rm_dirent(uuid, &fcb, s)) {
+
+    update_fcb(parent, uuid, &fcb);
+
+    myfs_dcache_put_negative(dcache, path);
+
+    rc = 0;
+  }
+
+  pthread_rwlock_unlock(&fs_lock);
+	
+  return rc;
+}
+
+
+
+// Delete a directory.
+// Read 'man 2 rmdir'.
+int myfs_rmdir(const char *path){
+  write_log("myfs_rmdir: %s\n",path);
+
+  char parent[strlen(path) + 1]; strcpy(parent, path); ascend_path(parent);
+
+  char copy_of_path[strlen(path) + 1]; strcpy(copy_of_path, path);
+
+  char *p = copy_of_path; char *s = NULL;
+
+  while(!split_path(&p, &s))
+    ;
+
+  myfcb fcb = {0}; uuid_t uuid; uuid_copy(uuid, zero_uuid);
+
+  myfcb directory = {0}; uuid_t directory_uuid;
+
+  int rc = -ENOENT;
+
+  pthread_rwlock_wrlock(&fs_lock);
+
+  if (!traverse(parent, uuid, &fcb) || !traverse(path, directory_uuid, &directory))
+    rc = -ENOENT;
+  else if (!S_ISDIR(directory.mode))
+    rc = -ENOTDIR;
+  else if (directory.size)
+    rc = -ENOTEMPTY;  // Its entries would be left behind with nothing referencing them
+  else if (rm_dirent(uuid, &fcb, s)) {
+
+    update_fcb(parent, uuid, &fcb);
+
+    myfs_dcache_put_negative(dcache, path);
+
+    rc = 0;
+  }
+
+  pthread_rwlock_unlock(&fs_lock);
+  
+  return rc;
+}
+
+// OPTIONAL - included as an example
+// Flush any cached data.
+int myfs_flush(const char *path, struct fuse_file_info *fi){
+  int retstat = 0;
+  
+  write_log("myfs_flush(path=\"%s\", fi=0x%08x)\n", path, fi);
+
+  myfs_handle_t *handle = (myfs_handle_t *) fi->fh;
+
+  // Only the fcb is written back, the blocks are left to the write-back of
+  // the cache and the commits
+  pthread_rwlock_rdlock(&fs_lock);
+
+  if (handle) {
+
+    pthread_rwlock_wrlock(&(handle->lock));
+
+    if (handle->dirty && !handle->unlinked)
+      write_handle_fcb(path, handle);
+
+    pthread_rwlock_unlock(&(handle->lock));
+  }
+
+  pthread_rwlock_unlock(&fs_lock);
+	
+  return retstat;
+}
+
+// Commits the file, along with everything else written so far, to disk.
+int myfs_fsync(const char *path, int datasync, struct fuse_file_info *fi){
+  write_log("myfs_fsync(path=\"%s\", datasync=%d, fi=0x%08x)\n", path, datasync, fi);
+
+  myfs_handle_t *handle = (myfs_handle_t *) fi->fh;
+
+  pthread_rwlock_wrlock(&fs_lock);
+
+  if (handle && handle->dirty && !handle->unlinked) {
+
+    update_fcb(path, handle->uuid, &(handle->fcb));
+
+    handle->dirty = false;
+  }
+
+  int rc = db_commit();
+
+  pthread_rwlock_unlock(&fs_lock);
+
+  return rc == UNQLITE_OK ? 0 : -EIO;
+}
+
+// OPTIONAL - included as an example
+// Release the file. There will be one call to release for each call to open.
+int myfs_release(const char *path, struct fuse_file_info *fi){
+  write_log("myfs_release(path=\"%s\", fi=0x%08x)\n", path, fi);
+
+  myfs_handle_t *handle = (myfs_handle_t *) fi->fh;
+
+  pthread_rwlock_rdlock(&fs_lock);
+
+  // Only unlink sets unlinked, and it holds the lock alone. Reclaiming the
+  // file frees its blocks, which is done holding the lock alone too.
+  if (handle->unlinked) {
+    pthread_rwlock_unlock(&fs_lock);
+    pthread_rwlock_wrlock(&fs_lock);
+  }
+
+  // While the handle can still be found, so a stat in the meantime sees it
+  pthread_rwlock_wrlock(&(handle->lock));
+
+  if (handle->dirty && !handle->unlinked)
+    write_handle_fcb(path, handle);
+
+  pthread_rwlock_unlock(&(handle->lock));
+
+  bool last = drop_handle(handle);
+
+  // The last reference to an unlinked file is gone, reclaim it
+  if (last && handle->unlinked) {
+    reclaim_file(handle);
+    db_rem(handle->uuid);
+  }
+
+  pthread_rwlock_unlock(&fs_lock);
+
+  if (last)
+    free_handle(handle);
+    
+  return 0;
+}
+
+// OPTIONAL - included as an example
+// Open a file. Open should check if the operation is permitted for the given flags (fi->flags).
+// Read 'man 2 open'.
+static int myfs_open(const char *path, struct fuse_file_info *fi){
+  write_log("myfs_open(path\"%s\", fi=0x%08x)\n", path, fi);
+
+  pthread_rwlock_rdlock(&fs_lock);
+  int rc = open_handle(path, fi);
+  pthread_rwlock_unlock(&fs_lock);
+
+  return rc;
+}
+
+/*
+  Version 1 stored each directory as one flat array of dirents under its file_data_id
+ */
+static void migrate_directory_v1(uuid_t uuid, myfcb *directory)
+{
+  if (!directory->size)
+    return;
 
-  myfcb current_directory = cached_root_fcb;
+  unqlite_int64 size = 0;
+  dirent_t *dirents = db_get_alloc(directory->file_data_id, &size);
 
-  uuid_t parent_uuid;
-  uuid_copy(parent_uuid, zero_uuid);
-  
-  char copy[strlen(path) + 1]; strcpy(copy, path);
-  
-  char *p = copy;
-  char *s = NULL;
+  db_rem(directory->file_data_id);
 
-  while(!split_path(&p, &s)) {
+  directory->size = size / sizeof(dirent_t);
 
-    if (!descend(s, &current_directory, parent_uuid))
-      return -ENOENT;
+  for (int i = 0; i < directory->size; i++) {
 
-  }
+    myfcb fcb = {0};
 
-  create_inode(parent_uuid, &current_directory, s, false, mode);
-  
-  return 0;
-}
+    db_get(dirents[i].uuid, &fcb, sizeof(myfcb));
 
-// Set update the times (actime, modtime) for a file. This FS only supports modtime.
-// Read 'man 2 utime'.
-static int myfs_utime(const char *path, struct utimbuf *ubuf){
-  write_log("myfs_utime(path=\"%s\", ubuf=0x%08x)\n", path, ubuf);
+    dir_insert(directory, dirents[i].name, dirents[i].uuid, fcb.mode);
 
-  myfcb fcb = {0}; uuid_t uuid; uuid_copy(uuid, zero_uuid);
+    if (S_ISDIR(fcb.mode))
+      migrate_directory_v1(dirents[i].uuid, &fcb);
+  }
 
-  if( traverse(path, uuid, &fcb) ) {
-    
-    fcb.atime = ubuf->actime;
-    fcb.mtime = ubuf->modtime;
+  db_put(uuid, directory, sizeof(myfcb));
 
-    db_put(uuid, &fcb, sizeof(myfcb));
-    
-    return 0;
-  }
-  
-  return -ENOENT;
+  free(dirents);
 }
 
-// Write to a file.
-// Read 'man 2 write'
-static int myfs_write(const char *path, const char *buf, size_t size, off_t offset, struct fuse_file_info *fi){   
-  write_log("myfs_write(path=\"%s\", buf=0x%08x, size=%d, offset=%lld, fi=0x%08x)\n", path, buf, size, offset, fi);
+/*
+  Version 2 buckets held fixed size dirents. They are already in (hash, name)
+  order, so each is rewritten in place in the packed format
+ */
+static void migrate_directory_v2(myfcb *directory)
+{
+  if (!directory->size)
+    return;
 
-  myfcb fcb = {0}; uuid_t uuid; uuid_copy(uuid, zero_uuid);
+  dir_header_t *header = dir_get_header(directory);
 
-  if( traverse(path, uuid, &fcb) ) {
-    
-    if(fcb.size < offset + size) {
-      //      internal_truncate(uuid, &fcb, offset + size);
+  for (int b = 0; b < header->buckets; b++) {
 
-      _internal_resize_(uuid, &fcb, offset + size);
-      
-    }
+    unqlite_int64 size = 0;
+    dirent_t *dirents = (dirent_t *) dir_get_bucket(directory, header->index[b].bucket, &size);
 
-    unsigned char * contents = calloc(sizeof(unsigned char), fcb.size);
+    size_t count = size / sizeof(dirent_t);
 
-    //    memcpy(contents + offset, buf, size);
+    unsigned char *data = malloc(count * PACKED_DIRENT_SIZE(MAX_FILE_NAME) + 1);
+    unqlite_int64 offset = 0;
 
-    _internal_put_(&fcb, buf, size, offset);
+    for (int i = 0; i < count; i++) {
 
-      //    db_put(fcb.file_data_id, contents, fcb.size);
+      myfcb fcb = {0};
 
-    free(contents);
-    
-    return size;
-  } 
-  
-  return -ENOENT;
-}
+      db_get(dirents[i].uuid, &fcb, sizeof(myfcb));
 
-// Set the size of a file.
-// Read 'man 2 truncate'.
-int myfs_truncate(const char *path, off_t newsize){    
-  write_log("myfs_truncate(path=\"%s\", newsize=%lld)\n", path, newsize);
+      packed_dirent_t *dirent = (packed_dirent_t *) (data + offset);
+      dirent->hash = hash_string(dirents[i].name);
+      uuid_copy(dirent->uuid, dirents[i].uuid);
+      dirent->type = MODE_TO_TYPE(fcb.mode);
+      dirent->length = strlen(dirents[i].name);
+      memcpy(dirent->name, dirents[i].name, dirent->length);
 
-  myfcb fcb = {0}; uuid_t uuid; uuid_copy(uuid, zero_uuid);
+      offset += PACKED_DIRENT_SIZE(dirent->length);
 
-  if( traverse(path, uuid, &fcb) ) {
+      if (S_ISDIR(fcb.mode))
+	migrate_directory_v2(&fcb);
+    }
 
+    dir_put_bucket(directory, header->index[b].bucket, data, offset);
 
-    _internal_resize_(uuid, &fcb, newsize);
+    free(data);
+    free(dirents);
+  }
 
-    //    internal_truncate(uuid, &fcb, newsize);
-    
-    return 0;
-  } 
-  
-  return -ENOENT;
+  free(header);
 }
 
-// Set permissions.
-// Read 'man 2 chmod'.
-int myfs_chmod(const char *path, mode_t mode){
-  write_log("myfs_chmod(fpath=\"%s\", mode=0%03o)\n", path, mode);
+static void migrate_directory_v3(myfcb *directory);
 
-  myfcb fcb = {0}; uuid_t uuid; uuid_copy(uuid, zero_uuid);
+/*
+  Version 3 keyed and log files didn't record how far they were written, so
+  each is taken to have been written up to its end
+ */
+static void migrate_file_v3(uuid_t uuid)
+{
+  myfcb fcb = {0};
 
-  if( traverse(path, uuid, &fcb) ) {
-    
-    fcb.mode = mode;
+  if (db_get(uuid, &fcb, sizeof(myfcb)) != UNQLITE_OK)
+    return;
 
-    db_put(uuid, &fcb, sizeof(myfcb));
-    
-    return 0;
-  }
-  
-    
-  return -ENOENT;
-}
+  if (S_ISDIR(fcb.mode)) {
 
-// Set ownership.
-// Read 'man 2 chown'.
-int myfs_chown(const char *path, uid_t uid, gid_t gid){   
-  write_log("myfs_chown(path=\"%s\", uid=%d, gid=%d)\n", path, uid, gid);
+    migrate_directory_v3(&fcb);
 
-  myfcb fcb = {0}; uuid_t uuid; uuid_copy(uuid, zero_uuid);
+  } else if (fcb.layout == LAYOUT_KEYED || fcb.layout == LAYOUT_LOG) {
 
-  if( traverse(path, uuid, &fcb) ) {
-    
-    fcb.uid = uid;
-    fcb.gid = gid;
+    fcb.keyed_blocks = (fcb.size + BLOCK_SIZE - 1) / BLOCK_SIZE;
 
     db_put(uuid, &fcb, sizeof(myfcb));
-    
-    return 0;
   }
-   
-  return -ENOENT;
 }
 
-// Create a directory.
-// Read 'man 2 mkdir'.
-static int myfs_mkdir(const char *path, mode_t mode)
+static void migrate_directory_v3(myfcb *directory)
 {
-  myfcb current_directory = cached_root_fcb;
+  if (!directory->size)
+    return;
 
-  uuid_t parent_uuid;
-  uuid_copy(parent_uuid, zero_uuid);
-  
-  char copy[strlen(path) + 1]; strcpy(copy, path);
-  
-  char *p = copy;
-  char *s = NULL;
+  dir_header_t *header = dir_get_header(directory);
 
-  while(!split_path(&p, &s)) {
+  for (int b = 0; b < header->buckets; b++) {
 
-    if (!descend(s, &current_directory, parent_uuid))
-      return -ENOENT;
+    unqlite_int64 size = 0;
+    unsigned char *data = dir_get_bucket(directory, header->index[b].bucket, &size);
 
-  }
+    for (unqlite_int64 offset = 0; offset < size; ) {
 
-  create_inode(parent_uuid, &current_directory, s, true, mode);
+      packed_dirent_t *dirent = (packed_dirent_t *) (data + offset);
 
-  return 0;
-}
+      migrate_file_v3(dirent->uuid);
 
+      offset += PACKED_DIRENT_SIZE(dirent->length);
+    }
 
-bool rm_dirent(uuid_t parent_uuid, myfcb *directory, char *file)
-{
-  bool found = false;
+    free(data);
+  }
 
-  size_t size = directory->size;
-  
-  if (size > 0) {
+  free(header);
+}
 
-    dirent_t * dirents = calloc(size, sizeof(dirent_t));
+/*
+  Files unlinked while they were open are reclaimed through their fcbs after
+  the migration, see orphans_read, so those are brought up to date too
+ */
+static void migrate_orphans_v3()
+{
+  unqlite_int64 size = 0;
+  unsigned char *record = db_get_alloc(orphans_uuid, &size);
 
-    db_get(directory->file_data_id, dirents, size * sizeof(dirent_t));
-  
-    for (int i = 0; i < size; i++) {
-      if (strcmp(dirents[i].name, file) == 0) {
+  if (!record)
+    return;
 
-	found = true;
+  uint32_t counts[2];
+  memcpy(counts, record, sizeof(counts));
 
-	myfcb fcb = {0};
+  unsigned char *file = record + sizeof(counts) + counts[0] * sizeof(myfs_packed_reap_t);
 
-	db_get(dirents[i].uuid, &fcb, sizeof(fcb));
+  for (uint32_t i = 0; i < counts[1]; i++, file += sizeof(uuid_t))
+    migrate_file_v3(file);
 
-	if (S_ISDIR(fcb.mode))
-	  db_rem(fcb.file_data_id);
-	else
-	  _internal_resize_(dirents[i].uuid, &fcb, 0);
+  free(record);
+}
 
-	db_rem(dirents[i].uuid);
+/*
+  Requeues what the reaper had left at the last commit, and reclaims the
+  files which were still open when they were unlinked, see orphans_write
+ */
+static void orphans_read()
+{
+  unqlite_int64 size = 0;
+  unsigned char *record = db_get_alloc(orphans_uuid, &size);
 
-	for (int j = i; j < size - 1; j++)
-	  dirents[j] = dirents[j + 1];
-	
-	break;
-      }
-    }
+  if (!record)
+    return;
 
-    directory->size--;
+  orphans_stored = true;
 
-    if (found)
-      if (size - 1 > 0)
-	db_put(directory->file_data_id, dirents, (size - 1) * sizeof(dirent_t));
-      else
-	db_rem(directory->file_data_id);
+  uint32_t counts[2];
+  memcpy(counts, record, sizeof(counts));
 
-    if (uuid_is_null(parent_uuid))
-      cached_root_fcb = *directory;
-  
-    free(dirents);
-    
-  }
+  myfs_packed_reap_t *run = (myfs_packed_reap_t *) (record + sizeof(counts));
 
-  return found;
-}
+  for (uint32_t i = 0; i < counts[0]; i++, run++)
+    myfs_reaper_add(&reaper, run->base, run->first, run->count);
 
-// Delete a file.
-// Read 'man 2 unlink'.
-int myfs_unlink(const char *path){
-  write_log("myfs_unlink: %s\n",path);
+  unsigned char *file = (unsigned char *) run;
 
-  char parent[strlen(path) + 1]; strcpy(parent, path); ascend_path(parent);
+  for (uint32_t i = 0; i < counts[1]; i++, file += sizeof(uuid_t)) {
 
-  char copy_of_path[strlen(path) + 1]; strcpy(copy_of_path, path);
+    myfcb fcb = {0};
 
-  char *p = copy_of_path; char *s = NULL;
+    if (db_get_fcb(file, &fcb) == UNQLITE_OK) {
 
-  while(!split_path(&p, &s))
-    ;
+      if (S_ISDIR(fcb.mode)) {
 
-  myfcb fcb = {0}; uuid_t uuid; uuid_copy(uuid, zero_uuid);
+	dir_free(&fcb);
 
-  traverse(parent, uuid, &fcb);
+      } else {
 
-  rm_dirent(uuid, &fcb, s);
-	
-  return 0;
-}
+	myfs_handle_t closed = {0};
 
+	closed.fcb = fcb;
+	myfs_handle_invalidate(&closed);
 
+	reclaim_file(&closed);
 
-// Delete a directory.
-// Read 'man 2 rmdir'.
-int myfs_rmdir(const char *path){
-  write_log("myfs_rmdir: %s\n",path);
+	free(closed.extents);
+      }
+    }
 
-  char parent[strlen(path) + 1]; strcpy(parent, path); ascend_path(parent);
+    db_rem(file);
+  }
 
-  char copy_of_path[strlen(path) + 1]; strcpy(copy_of_path, path);
+  printf("init_fs: %u runs of blocks and %u unlinked files left to reclaim\n", counts[0], counts[1]);
 
-  char *p = copy_of_path; char *s = NULL;
+  free(record);
+}
 
-  while(!split_path(&p, &s))
-    ;
+/*
+  Brings a store written by an older version up to the current on-disk format
+ */
+static void migrate_fs(superblock_t *superblock)
+{
+  if (superblock->version < 2) {
 
-  myfcb fcb = {0}; uuid_t uuid; uuid_copy(uuid, zero_uuid);
+    printf("init_fs: migrating directories to the hashed format\n");
+    migrate_directory_v1(zero_uuid, &cached_root_fcb);
 
-  traverse(parent, uuid, &fcb);
+  } else if (superblock->version < 3) {
 
-  rm_dirent(uuid, &fcb, s);
-  
-  return 0;
-}
+    printf("init_fs: migrating directories to packed dirents\n");
+    migrate_directory_v2(&cached_root_fcb);
+  }
 
-// OPTIONAL - included as an example
-// Flush any cached data.
-int myfs_flush(const char *path, struct fuse_file_info *fi){
-  int retstat = 0;
-  
-  write_log("myfs_flush(path=\"%s\", fi=0x%08x)\n", path, fi);
+  if (superblock->version < 4) {
 
-  flush_cache(root);
-	
-  return retstat;
-}
+    printf("init_fs: recording how far keyed files were written\n");
+    migrate_directory_v3(&cached_root_fcb);
+    migrate_orphans_v3();
+  }
 
-// OPTIONAL - included as an example
-// Release the file. There will be one call to release for each call to open.
-int myfs_release(const char *path, struct fuse_file_info *fi){
-  write_log("myfs_release(path=\"%s\", fi=0x%08x)\n", path, fi);
-    
-  return -ENOENT;
-}
+  superblock->version = MYFS_VERSION;
 
-// OPTIONAL - included as an example
-// Open a file. Open should check if the operation is permitted for the given flags (fi->flags).
-// Read 'man 2 open'.
-static int myfs_open(const char *path, struct fuse_file_info *fi){
-  write_log("myfs_open(path\"%s\", fi=0x%08x)\n", path, fi);
+  int rc = db_put(SUPERBLOCK_KEY, superblock, sizeof(superblock_t));
 
-  // TODO
-  
-  return 0;
+  if( rc != UNQLITE_OK ) error_handler(rc);
 }
 
 // Initialise the in-memory data structures from the store. If the root object (from the store) is empty then create a root fcb (directory)
@@ -1093,15 +3714,57 @@ void init_fs(){
     
   uuid_clear(zero_uuid);
 	
+  // Requests are served on several threads, which all share the one handle
+  rc = unqlite_lib_config(UNQLITE_LIB_CONFIG_THREAD_LEVEL_MULTI);
+  if( rc != UNQLITE_OK ) error_handler(rc);
+
+  // A store keeps the page size it was made with, a new one gets the
+  // smallest a block record fits in whole (see BLOCK_RECORD_SIZE)
+  size_t existing_page_size = store_page_size(DATABASE_NAME);
+
+  if (existing_page_size)
+    page_size = existing_page_size;
+  else if (!page_size)
+    for (page_size = PAGE_SIZE_MIN; page_size < BLOCK_RECORD_SIZE; page_size <<= 1);
+
+  printf("init_fs: page size %zu\n", page_size);
+
+  rc = unqlite_lib_config(UNQLITE_LIB_CONFIG_PAGE_SIZE, (int) page_size);
+  if( rc != UNQLITE_OK ) error_handler(rc);
+
   // Open the database.
   rc = unqlite_open(&pDb,DATABASE_NAME,UNQLITE_OPEN_CREATE);
   if( rc != UNQLITE_OK ) error_handler(rc);
 
+  // Transactions are committed by db_commit, never implicitly
+  unqlite_config(pDb, UNQLITE_CONFIG_DISABLE_AUTO_COMMIT);
+
+  // The data file, holding the blocks of flat files
+  data_fd = open(DATA_FILE_NAME, O_RDWR | O_CREAT, 0644);
+  if (data_fd < 0) error_handler(UNQLITE_IOERR);
+
+  data_file_blocks = lseek(data_fd, 0, SEEK_END) / BLOCK_SIZE;
+
+  if (mmap_reads)
+    data_map_open();
+
+  alloc_read();
+
+  // The log, holding the blocks of log files
+  log_fd = open(LOG_FILE_NAME, O_RDWR | O_CREAT, 0644);
+  if (log_fd < 0) error_handler(UNQLITE_IOERR);
+
+  if (log_read_segments() != UNQLITE_OK) error_handler(UNQLITE_IOERR);
+
   unqlite_int64 nBytes = sizeof(myfcb);  // Data length
 
 
-  hashtable = myfs_mk_hashtable();
-  root = myfs_mk_root();
+  cache = myfs_mk_shards(cache_policy, cache_size, BLOCK_SIZE);
+  itable = myfs_mk_shards(cache_policy, inode_cache_size, sizeof(myfcb));
+
+  dcache = myfs_mk_dcache();
+
+  handles = myfs_mk_handles();
 
   // Try to fetch the root element
   // The last parameter is a pointer to a variable which will hold the number of bytes actually read
@@ -1109,6 +3772,8 @@ void init_fs(){
 
   rc = db_get(ROOT_OBJECT_KEY, &cached_root_fcb, nBytes);
 
+  bool fresh = (rc == UNQLITE_NOTFOUND);
+
 
   // if it doesn't exist, we need to create one and put it into the database. This will be the root
   // directory of our filesystem i.e. "/"
@@ -1147,19 +3812,82 @@ void init_fs(){
       }
  
     }
+
+  superblock_t superblock = {0};
+
+  // Stores written before the superblock was introduced are version 1
+  if (db_get(SUPERBLOCK_KEY, &superblock, sizeof(superblock_t)) == UNQLITE_NOTFOUND)
+    superblock.version = fresh ? MYFS_VERSION : 1;
+
+  if (superblock.version > MYFS_VERSION) {
+    printf("init_fs: store was written by a newer version (%u). Doing nothing.\n", superblock.version);
+    exit(-1);
+  }
+
+  migrate_fs(&superblock);
+
+  orphans_read();
+
+  rc = db_commit();
+  if( rc != UNQLITE_OK ) error_handler(rc);
        
 }
 
+/*
+  Starts the background thread. It is started from init rather than before
+  fuse_main, which forks, so that it runs in the process serving requests.
+ */
+static void *myfs_init(struct fuse_conn_info *conn)
+{
+  background_started = pthread_create(&background, NULL, background_run, NULL) == 0;
+
+  return fuse_get_context()->private_data;
+}
+
+/*
+  Stops the background thread, whatever it leaves is done by shutdown_fs
+ */
+static void myfs_destroy(void *private_data)
+{
+  if (!background_started)
+    return;
+
+  pthread_mutex_lock(&background_lock);
+  background_stop = true;
+  pthread_cond_signal(&background_wake);
+  pthread_mutex_unlock(&background_lock);
+
+  pthread_join(background, NULL);
+
+  background_started = false;
+}
+
 void shutdown_fs(){
 
-  flush_cache(root);
+  // Whatever the reaper has left is recorded by the commit, and reaped in
+  // the background after the next mount rather than holding up the unmount
+  db_commit();
+
+  cache_report(cache, "block cache", logfile);
+  cache_report(itable, "inode table", logfile);
+
+  log_report(logfile);
+
+  if (data_map) {
+    fprintf(logfile, "data map: %lu blocks read from the mapping\n", data_map_reads);
+    munmap((void *) data_map, DATA_MAP_SIZE);
+  }
 
   unqlite_close(pDb);
+
+  close(data_fd);
+  close(log_fd);
 }
 
  
 static struct fuse_operations myfs_oper = {
   .getattr	= myfs_getattr,
+  .fgetattr	= myfs_fgetattr,
   .readdir	= myfs_readdir,
   .open		= myfs_open,
   .read		= myfs_read,
@@ -1167,19 +3895,150 @@ static struct fuse_operations myfs_oper = {
   .utime 		= myfs_utime,
   .write		= myfs_write,
   .truncate	= myfs_truncate,
+  .ftruncate	= myfs_ftruncate,
   .flush		= myfs_flush,
+  .fsync	= myfs_fsync,
+  .init		= myfs_init,
+  .destroy	= myfs_destroy,
   .release	= myfs_release,
   .mkdir = myfs_mkdir,
   .rmdir = myfs_rmdir,
   .unlink = myfs_unlink,
   .chmod = myfs_chmod,
   .chown = myfs_chown,
+#if FUSE_VERSION >= 28
+  // A file unlinked while it is open has no path, but it is still read and
+  // written through its handle
+  .flag_nullpath_ok = 1,
+#endif
 };
 
+/*
+  Mount options, given as -o name=value
+ */
+struct myfs_options
+{
+  char *cache_size;
+  char *inode_cache_size;
+  char *cache_policy;
+  char *layout;
+  unsigned int dirty_ratio;
+  unsigned int dirty_age;
+  unsigned int commit_interval;
+  char *commit_bytes;
+  char *page_size;
+  unsigned int clean_threshold;
+  int mmap;
+};
+
+static struct myfs_options options = { NULL, NULL, NULL, NULL, DIRTY_RATIO_DEFAULT, DIRTY_AGE_DEFAULT, COMMIT_INTERVAL_DEFAULT, NULL, NULL, CLEAN_THRESHOLD_DEFAULT, 0 };
+
+#define MYFS_OPT(t, p) { t, offsetof(struct myfs_options, p), 0 }
+
+static const struct fuse_opt myfs_opts[] = {
+  MYFS_OPT("cache_size=%s", cache_size),
+  MYFS_OPT("inode_cache_size=%s", inode_cache_size),
+  MYFS_OPT("cache_policy=%s", cache_policy),
+  MYFS_OPT("layout=%s", layout),
+  MYFS_OPT("dirty_ratio=%u", dirty_ratio),
+  MYFS_OPT("dirty_age=%u", dirty_age),
+  MYFS_OPT("commit_interval=%u", commit_interval),
+  MYFS_OPT("commit_bytes=%s", commit_bytes),
+  MYFS_OPT("page_size=%s", page_size),
+  MYFS_OPT("clean_threshold=%u", clean_threshold),
+  { "mmap", offsetof(struct myfs_options, mmap), 1 },
+  FUSE_OPT_END
+};
+
+/*
+  Parses a number of bytes, optionally suffixed with K, M or G
+ */
+static size_t parse_size(const char *s)
+{
+  char *end;
+  size_t n = strtoull(s, &end, 10);
+
+  switch (*end) {
+  case 'G': case 'g': n <<= 10; /* fall through */
+  case 'M': case 'm': n <<= 10; /* fall through */
+  case 'K': case 'k': n <<= 10;
+  }
+
+  return n;
+}
+
 int main(int argc, char *argv[]){	
   int fuserc;
   struct myfs_state *myfs_internal_state;
 
+  // Pick out our own options, leaving the rest for fuse
+  struct fuse_args args = FUSE_ARGS_INIT(argc, argv);
+
+  if (fuse_opt_parse(&args, &options, myfs_opts, NULL) == -1)
+    return 1;
+
+  if (options.cache_size)
+    cache_size = parse_size(options.cache_size);
+
+  if (options.inode_cache_size)
+    inode_cache_size = parse_size(options.inode_cache_size);
+
+  if (options.cache_policy) {
+
+    int i = 0;
+
+    while (i <= CACHE_ARC && strcmp(options.cache_policy, cache_policy_names[i]) != 0)
+      i++;
+
+    if (i > CACHE_ARC) {
+      fprintf(stderr, "unknown cache_policy %s, expected lru, 2q or arc\n", options.cache_policy);
+      return 1;
+    }
+
+    cache_policy = i;
+  }
+
+  // The layout given to new files, existing files keep theirs
+  if (options.layout) {
+
+    if (strcmp(options.layout, "extents") == 0)
+      default_layout = LAYOUT_EXTENTS;
+    else if (strcmp(options.layout, "blockmap") == 0)
+      default_layout = LAYOUT_BLOCKMAP;
+    else if (strcmp(options.layout, "keyed") == 0)
+      default_layout = LAYOUT_KEYED;
+    else if (strcmp(options.layout, "flat") == 0)
+      default_layout = LAYOUT_FLAT;
+    else if (strcmp(options.layout, "log") == 0)
+      default_layout = LAYOUT_LOG;
+    else {
+      fprintf(stderr, "unknown layout %s, expected extents, blockmap, keyed, flat or log\n", options.layout);
+      return 1;
+    }
+  }
+
+  dirty_ratio = options.dirty_ratio;
+  dirty_age = options.dirty_age;
+
+  commit_interval = options.commit_interval;
+
+  clean_threshold = options.clean_threshold;
+
+  mmap_reads = options.mmap;
+
+  if (options.commit_bytes)
+    commit_bytes = parse_size(options.commit_bytes);
+
+  if (options.page_size) {
+
+    page_size = parse_size(options.page_size);
+
+    if (page_size < PAGE_SIZE_MIN || page_size > PAGE_SIZE_MAX || (page_size & (page_size - 1))) {
+      fprintf(stderr, "invalid page_size %s, expected a power of two from 512 to 64K\n", options.page_size);
+      return 1;
+    }
+  }
+
   //Setup the log file and store the FILE* in the private data object for the file system.	
   myfs_internal_state = malloc(sizeof(struct myfs_state));
   myfs_internal_state->logfile = init_log_file();
@@ -1190,7 +4049,9 @@ int main(int argc, char *argv[]){
   // Now pass our function pointers over to FUSE, so they can be called whenever someone
   // tries to interact with our filesystem. The internal state contains a file handle
   // for the logging mechanism
-  fuserc = fuse_main(argc, argv, &myfs_oper, myfs_internal_state);
+  fuserc = fuse_main(args.argc, args.argv, &myfs_oper, myfs_internal_state);
+
+  fuse_opt_free_args(&args);
 	
   //Shutdown the file system.
   shutdown_fs();
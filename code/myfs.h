@@ -9,6 +9,7 @@
 #include <sys/stat.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
 #include <fuse.h>
 
 #define KEY_SIZE 16
@@ -28,6 +29,51 @@
 
 #define SINGLE_INDIRECT_BLOCKS 256
 
+/*
+  A file's data is laid out in one of three ways. The original block map
+  holds the random uuid of each block, in 13 direct slots and single and
+  double indirect blocks. An extent maps a run of logical blocks onto a run
+  of physical ones, whose keys are derived from the file's file_data_id, so a
+  file written in order needs a single extent however large it is. A keyed
+  file has no map at all: block n is stored under the key derived from
+  file_data_id and n, and a block which was never written has no record.
+  A flat file is mapped by extents too, but its physical blocks are blocks
+  of the data file, given out by the allocator, and never touch the store.
+  A log file is keyed like a keyed file, but its blocks are appended to the
+  log and the store only records where the latest copy of each one is.
+  Keyed and log files remember how far they were ever written, so that
+  cutting one short only deletes keys which may have a record.
+
+  Fcbs written before the layout field existed read back with it zeroed,
+  as block mapped files.
+ */
+#define LAYOUT_BLOCKMAP 0
+#define LAYOUT_EXTENTS 1
+#define LAYOUT_KEYED 2
+#define LAYOUT_FLAT 3
+#define LAYOUT_LOG 4
+
+typedef struct
+{
+  uint32_t logical;
+  uint32_t length;
+  uint64_t physical;
+
+} extent_t;
+
+// Extents held in the fcb itself, more are kept in a record of their own
+#define INLINE_EXTENTS 14
+
+/*
+  The largest file each layout can map, in blocks. The block map runs to a
+  triple indirect block, about 64 GiB, an extent addresses 2^32 blocks, and
+  so does a keyed or log file, whose block numbers are carried in 32 bits
+  too.
+ */
+#define BLOCKMAP_MAX_BLOCKS (13 + 256 + 256 * 256 + 256 * 256 * 256)
+#define EXTENTS_MAX_BLOCKS 0xffffffffULL
+#define KEYED_MAX_BLOCKS 0xffffffffULL
+
 
 typedef struct _myfcb
 {
@@ -45,13 +91,35 @@ typedef struct _myfcb
   off_t size;     /* size */
 
 
-  struct
+  union
   {
-    uuid_t direct_blocks[DIRECT_BLOCKS];
-    uuid_t singley_indirect_blocks;
-    uuid_t doubley_indirect_blocks;
+    // LAYOUT_BLOCKMAP
+    struct
+    {
+      uuid_t direct_blocks[DIRECT_BLOCKS];
+      uuid_t singley_indirect_blocks;
+      uuid_t doubley_indirect_blocks;
+    };
+
+    // LAYOUT_EXTENTS
+    struct
+    {
+      uint32_t extent_count;
+      uint32_t extent_reserved[3];
+      extent_t extents[INLINE_EXTENTS];
+    };
+
+    // LAYOUT_KEYED and LAYOUT_LOG, one past the last block ever written
+    struct
+    {
+      uint32_t keyed_blocks;
+    };
   };
 
+  uint32_t layout;
+
+  // LAYOUT_BLOCKMAP, mapping the blocks past the double indirect ones
+  uuid_t tripley_indirect_blocks;
     
 } myfcb;
 
@@ -108,6 +176,84 @@ typedef struct _block_
 } block_t;
 
 
+/*
+  Directories are indexed by the hash of their entries' names. The directory's
+  file_data_id holds a header which partitions the hash space into ranges,
+  sorted by their lowest hash, and each range is stored in a bucket of its own.
+  A bucket is a separate record, holding its dirents sorted by (hash, name),
+  whose key is derived from the file_data_id and the bucket number.
+
+  A lookup therefore costs a header fetch plus one bucket fetch, and an insert
+  or removal only rewrites the affected bucket. The header is rewritten only
+  when a bucket is split or dropped.
+ */
+
+#define DIR_BUCKET_SIZE BLOCK_SIZE
+
+typedef struct _dir_index_
+{
+  uint32_t hash;
+  uint32_t bucket;
+  
+} dir_index_t;
+
+typedef struct _dir_header_
+{
+  uint32_t buckets;
+  uint32_t next_bucket;
+
+  dir_index_t index[];
+  
+} dir_header_t;
+
+/*
+  Within a bucket dirents are packed back to back, each a 22 byte header
+  followed by the name, which is not nul terminated. The hash is stored so
+  that a lookup can skip most entries without touching their names.
+ */
+typedef struct __attribute__((packed)) _packed_dirent_
+{
+  uint32_t hash;
+  uuid_t uuid;
+  uint8_t type;   /* file type bits of the mode, see MODE_TO_TYPE */
+  uint8_t length; /* of the name */
+
+  char name[];
+  
+} packed_dirent_t;
+
+#define PACKED_DIRENT_SIZE(length) (sizeof(packed_dirent_t) + (length))
+
+#define MODE_TO_TYPE(mode) (((mode) & S_IFMT) >> 12)
+#define TYPE_TO_MODE(type) ((mode_t) (type) << 12)
+
+/*
+  readdir offsets name a position in (hash, name) order rather than in the
+  buckets, so they survive buckets being split or dropped between calls. The
+  offset handed out with a dirent is the position just past it: its hash and
+  how many dirents with that hash precede it, itself included. Offsets 1 and 2
+  follow "." and "..".
+ */
+#define DIR_OFFSET_BASE 3
+#define DIR_OFFSET(hash, n) (DIR_OFFSET_BASE + ((off_t) (hash) << 16) + (n))
+#define DIR_OFFSET_HASH(offset) ((uint32_t) (((offset) - DIR_OFFSET_BASE) >> 16))
+#define DIR_OFFSET_COUNT(offset) ((int) (((offset) - DIR_OFFSET_BASE) & 0xffff))
+
+
+/*
+  The superblock records the version of the on-disk format, so that stores
+  written by older versions can be migrated when they are mounted
+ */
+
+#define MYFS_VERSION 4
+
+typedef struct _superblock_
+{
+  uint32_t version;
+  
+} superblock_t;
+
+
 
 // Some other useful definitions we might need
 
@@ -121,6 +267,8 @@ extern unqlite_int64 root_object_size_value;
 #define ROOT_OBJECT_KEY zero_uuid
 #define ROOT_OBJECT_KEY_SIZE 16
 
+#define SUPERBLOCK_KEY superblock_uuid
+
 // This is the size of a regular key used to fetch things from the 
 // database. We use uuids as keys, so 16 bytes each
 
@@ -129,6 +277,12 @@ extern unqlite_int64 root_object_size_value;
 // to start over with a fresh filesystem
 #define DATABASE_NAME "myfs.db"
 
+// The file which holds the blocks of files with the flat layout
+#define DATA_FILE_NAME "myfs.db-data"
+
+// The file which holds the segments of the log, for files with the log layout
+#define LOG_FILE_NAME "myfs.db-log"
+
 extern unqlite *pDb;
 
 extern void error_handler(int);
@@ -138,6 +292,7 @@ extern FILE* init_log_file();
 extern void write_log(const char *, ...);
 
 extern uuid_t zero_uuid;
+extern uuid_t superblock_uuid;
 
 // We can use the fs_state struct to pass information to fuse, which our handler functions can
 // then access. In this case, we use it to pass a file handle for the file used for logging
@@ -171,11 +326,16 @@ FILE *init_log_file(){
   return logfile;
 }
 
-// Write to the provided handle
+// Write to the provided handle. Outside a request, in the background
+// thread and at init and shutdown, there is no fuse context to take it
+// from, so the global handle is used
 void write_log(const char *format, ...){
+  struct fuse_context *context = fuse_get_context();
+  FILE *out = context && context->private_data ? NEWFS_PRIVATE_DATA->logfile : logfile;
   va_list ap;
   va_start(ap, format);
-  vfprintf(NEWFS_PRIVATE_DATA->logfile, format, ap);
+  vfprintf(out, format, ap);
+  va_end(ap);
 }
 
 // Simple error handler which cleans up and quits
@@ -226,24 +386,136 @@ typedef struct
 } myfs_key_t;
 
 
+/*
+  Slab Allocator
+
+  Cache nodes and their block frames come from slabs of fixed size objects.
+  Memory is carved out a chunk of objects at a time, and freed objects are
+  threaded onto a free list for reuse rather than handed back to malloc.
+  Every cache draws on the same slabs, so each slab has a lock of its own.
+ */
+
+#define SLAB_OBJECTS 64
+
+typedef struct
+{
+  size_t object_size;
+  size_t align;       /* of each chunk, 0 for malloc's */
+
+  void *free;
+
+  pthread_mutex_t lock;
+  
+} myfs_slab_t;
+
+void *myfs_slab_alloc(myfs_slab_t *slab)
+{
+  pthread_mutex_lock(&(slab->lock));
+
+  if (!slab->free) {
+
+    char *chunk = slab->align
+      ? aligned_alloc(slab->align, slab->object_size * SLAB_OBJECTS)
+      : malloc(slab->object_size * SLAB_OBJECTS);
+
+    for (int i = SLAB_OBJECTS - 1; i >= 0; i--) {
+      *(void **) (chunk + i * slab->object_size) = slab->free;
+      slab->free = chunk + i * slab->object_size;
+    }
+  }
+
+  void *object = slab->free;
+  slab->free = *(void **) object;
+
+  pthread_mutex_unlock(&(slab->lock));
+
+  return object;
+}
+
+void myfs_slab_free(myfs_slab_t *slab, void *object)
+{
+  pthread_mutex_lock(&(slab->lock));
+
+  *(void **) object = slab->free;
+  slab->free = object;
+
+  pthread_mutex_unlock(&(slab->lock));
+}
+
+
+// Where the latest copy of a block of the log is, see Log below
+typedef struct
+{
+  uint32_t segment;
+  uint32_t slot;
+
+} myfs_log_loc_t;
+
 typedef struct _myfs_node_
 {
   struct _myfs_node_ *next;
   struct _myfs_node_ *prev;
 
+  struct _myfs_node_ *chain;
+
+  // The list root the node is on. A list root keeps the bytes on its list in size
+  struct _myfs_node_ *list;
+
   uuid_t key;
   size_t size;
-  void  *data;
+  void  *data;   /* NULL for a ghost */
+
+  // Set on a hit, the policy acts on it when the node comes up for eviction
+  bool referenced;
+
+  // The store has nothing under the key, the data is all zeroes
+  bool absent;
+
+  // For a block of the log, whether where its copy in the log is (segment
+  // NO_SEGMENT if it has none) is known, so that it needn't be looked up
+  bool located;
+  myfs_log_loc_t loc;
+
+  // Dirty nodes are also linked, oldest first, on the dirty list
+  bool dirty;
+  time_t dirtied;
+  struct _myfs_node_ *dirty_next;
+  struct _myfs_node_ *dirty_prev;
   
 } myfs_node_t;
 
+static myfs_slab_t node_slab = { sizeof(myfs_node_t), 0, NULL, PTHREAD_MUTEX_INITIALIZER };
+
+// Block frames are page aligned
+static myfs_slab_t frame_slab = { BLOCK_SIZE, BLOCK_SIZE, NULL, PTHREAD_MUTEX_INITIALIZER };
+
+// Fcbs in the inode table get frames of their own size
+static myfs_slab_t fcb_slab = { sizeof(myfcb), 0, NULL, PTHREAD_MUTEX_INITIALIZER };
+
+/*
+  The slab a payload of the given size comes from, NULL for malloc
+ */
+static myfs_slab_t *myfs_frame_slab(size_t size)
+{
+  if (size <= sizeof(myfcb))
+    return &fcb_slab;
+
+  if (size <= BLOCK_SIZE)
+    return &frame_slab;
+
+  return NULL;
+}
+
 myfs_node_t *myfs_mk_node(uuid_t uuid, void * data, size_t size)
 {
-  myfs_node_t * node = calloc(1, sizeof(myfs_node_t));
+  myfs_node_t * node = myfs_slab_alloc(&node_slab);
+  memset(node, 0, sizeof(myfs_node_t));
 
   node->size = size;
 
-  node->data = calloc(1, size);
+  myfs_slab_t *slab = myfs_frame_slab(size);
+
+  node->data = slab ? myfs_slab_alloc(slab) : malloc(size);
   memcpy(node->data, data, size);
 
   uuid_copy(node->key, uuid);
@@ -251,18 +523,42 @@ myfs_node_t *myfs_mk_node(uuid_t uuid, void * data, size_t size)
   return node;
 }
 
+void myfs_init_root(myfs_node_t *node)
+{
+  node->next = node->prev = node;
+  node->dirty_next = node->dirty_prev = node;
+}
+
 myfs_node_t *myfs_mk_root()
 {
   myfs_node_t * node = calloc(1, sizeof(myfs_node_t));
-  node->next = node->prev = node;
+  myfs_init_root(node);
 
   return node;
 }
 
+/*
+  Frees the data of a node, turning it into a ghost
+ */
+void myfs_rm_frame(myfs_node_t *node)
+{
+  if (!node->data)
+    return;
+
+  myfs_slab_t *slab = myfs_frame_slab(node->size);
+  
+  if (slab)
+    myfs_slab_free(slab, node->data);
+  else
+    free(node->data);
+
+  node->data = NULL;
+}
+
 void myfs_rm_node(myfs_node_t *node)
 {
-  free(node->data);
-  free(node);
+  myfs_rm_frame(node);
+  myfs_slab_free(&node_slab, node);
 }
 
 void myfs_queue_top(myfs_node_t *root, myfs_node_t *node)
@@ -300,99 +596,152 @@ void myfs_queue_rem(myfs_node_t *node)
 }
 
 
-#define TABLE_SIZE 10
-
-#define CACHE_EVICT_SIZE 30
-
-typedef struct _bucket_
+/*
+  Adds a node to the front of a list, accounting for its bytes on the list root
+ */
+void myfs_list_add(myfs_node_t *list, myfs_node_t *node)
 {
-  struct _bucket_ *next;
-  struct _bucket_ *prev;
+  myfs_queue_top(list, node);
 
-  myfs_node_t *node;
-  
-} bucket_t;
+  node->list = list;
+  list->size += node->size;
+}
 
-void myfs_bucket_add(bucket_t *root, bucket_t *node)
+void myfs_list_rem(myfs_node_t *node)
 {
-  node->next = root->next;
-  node->prev = root;
-
-  root->next->prev = node;
+  myfs_queue_rem(node);
 
-  root->next = node;
+  node->list->size -= node->size;
+  node->list = NULL;
 }
 
-void myfs_bucket_rem(bucket_t *node)
-{
-  bucket_t *next = node->next;
-  bucket_t *prev = node->prev;
+/*
+  The hashtable starts out small and doubles whenever it holds more nodes than
+  it has buckets. The number of buckets is a power of two, so a bucket is picked
+  by masking the hash, and chains stay short however large the cache grows.
+  Nodes are chained through their own chain pointer, so putting a node in the
+  table allocates nothing.
+
+  The capacity of the cache is a byte budget (see -o cache_size) rather than a
+  number of nodes.
+
+  Blocks written through the cache are marked dirty and only reach the store
+  when they are evicted, flushed, or written back by the policy in myfs.c. Clean
+  blocks are dropped on eviction without touching the store.
+ */
 
-  if (next)
-    next->prev = prev;
+#define TABLE_INITIAL_SIZE 64
 
-  prev->next = next;
-  
-  free(node);
-}
+// 64 MiB of blocks. Nodes and frames come from slabs, so a large cache costs
+// no more per block than a small one, and it is enough to split into shards.
+#define CACHE_DEFAULT_SIZE (16384 * BLOCK_SIZE)
+
+#define INODE_CACHE_DEFAULT_SIZE (4096 * sizeof(myfcb))
 
+// Percentage of the cache which may be dirty, and seconds a block may stay dirty
+#define DIRTY_RATIO_DEFAULT 50
+#define DIRTY_AGE_DEFAULT 30
 
 typedef struct
 {
   int s;
-  bucket_t buckets[TABLE_SIZE];
+  size_t bytes;
+
+  size_t size;
+  myfs_node_t **buckets;
 
 } myfs_hashtable_t;
 
 /* 
    A hash function for uuid's adapted from https://stackoverflow.com/questions/2253693/
+
+   Only the low bits pick a bucket, so the result is run through the
+   MurmurHash3 finaliser to spread every bit of the key into them
  */
 unsigned int hash(uuid_t uuid)
 {
   myfs_key_t key = {0};
   uuid_copy(key.uuid, uuid);
 
-  return key.a ^ key.b ^ key.c ^ key.d;
-}
+  unsigned int h = key.a ^ key.b ^ key.c ^ key.d;
 
-bucket_t *mk_bucket(myfs_node_t * node)
-{
-  bucket_t *bucket = calloc(1, sizeof(bucket_t));
-  bucket->node = node;
-  return bucket;
+  h ^= h >> 16;
+  h *= 0x85ebca6b;
+  h ^= h >> 13;
+  h *= 0xc2b2ae35;
+  h ^= h >> 16;
+
+  return h;
 }
 
 myfs_hashtable_t * myfs_mk_hashtable()
 {
   myfs_hashtable_t * hashtable = calloc(1, sizeof(myfs_hashtable_t));
-  
-  for (int i = 0; i < TABLE_SIZE; i++)
-    hashtable->buckets[i].next = hashtable->buckets[i].prev = &(hashtable->buckets[i]);
 
-   return hashtable;
+  hashtable->size = TABLE_INITIAL_SIZE;
+  hashtable->buckets = calloc(hashtable->size, sizeof(myfs_node_t *));
+
+  return hashtable;
+}
+
+static myfs_node_t **myfs_hashtable_bucket(myfs_hashtable_t *hashtable, uuid_t key)
+{
+  return &(hashtable->buckets[hash(key) & (hashtable->size - 1)]);
+}
+
+/*
+  Doubles the number of buckets, moving every node over to the new table
+ */
+static void myfs_hashtable_grow(myfs_hashtable_t *hashtable)
+{
+  myfs_node_t **old = hashtable->buckets;
+  size_t old_size = hashtable->size;
+
+  hashtable->size *= 2;
+  hashtable->buckets = calloc(hashtable->size, sizeof(myfs_node_t *));
+
+  for (int i = 0; i < old_size; i++) {
+
+    myfs_node_t *c = old[i];
+
+    while (c) {
+
+      myfs_node_t *chain = c->chain;
+      myfs_node_t **n = myfs_hashtable_bucket(hashtable, c->key);
+
+      c->chain = *n;
+      *n = c;
+
+      c = chain;
+    }
+  }
+
+  free(old);
 }
 
 void myfs_hashtable_put(myfs_hashtable_t *hashtable, myfs_node_t *node)
 {
+  if (hashtable->s >= hashtable->size)
+    myfs_hashtable_grow(hashtable);
   
-  bucket_t *n = &(hashtable->buckets[hash(node->key) % TABLE_SIZE]);
-  bucket_t *b = mk_bucket(node);
+  myfs_node_t **n = myfs_hashtable_bucket(hashtable, node->key);
 
-  myfs_bucket_add(n, b);
+  node->chain = *n;
+  *n = node;
 
   hashtable->s++;
+  hashtable->bytes += node->size;
   
 }
 
 myfs_node_t *myfs_hashtable_get(myfs_hashtable_t *hashtable, uuid_t key)
 {
-  bucket_t *n = &(hashtable->buckets[hash(key) % TABLE_SIZE]);
-  bucket_t *c = n;
+  myfs_node_t *c = *myfs_hashtable_bucket(hashtable, key);
 
-  while((c = c->next) != n) {
+  for (; c; c = c->chain) {
 
-    if (uuid_compare(c->node->key, key) == 0)
-      return c->node;
+    if (uuid_compare(c->key, key) == 0)
+      return c;
   }
 
   return NULL;
@@ -400,15 +749,15 @@ myfs_node_t *myfs_hashtable_get(myfs_hashtable_t *hashtable, uuid_t key)
 
 void myfs_hashtable_del(myfs_hashtable_t *hashtable, uuid_t key)
 {
-  bucket_t *n = &(hashtable->buckets[hash(key) % TABLE_SIZE]);
-  bucket_t *c = n;
+  myfs_node_t **c = myfs_hashtable_bucket(hashtable, key);
 
-  while((c = c->next) != n) {
+  for (; *c; c = &((*c)->chain)) {
 
-    if (uuid_compare(c->node->key, key) == 0) {
+    if (uuid_compare((*c)->key, key) == 0) {
       hashtable->s--;
+      hashtable->bytes -= (*c)->size;
 
-      myfs_bucket_rem(c);
+      *c = (*c)->chain;
       
       return;
     }
@@ -417,21 +766,1159 @@ void myfs_hashtable_del(myfs_hashtable_t *hashtable, uuid_t key)
 
 }
 
-void cache_evict(myfs_hashtable_t *hashtable, myfs_node_t *root, myfs_node_t *to_be_evicted)
+
+/*
+  Block Cache
+
+  Resident blocks are kept on one or two lists, depending on the replacement
+  policy chosen with -o cache_policy:
+
+  lru - a single list. The least recently used block is evicted.
+
+  2q  - new blocks go on a FIFO (A1in). When a block falls out of the FIFO
+        its key is kept on a ghost list (A1out). Only a block asked for again
+        while it is a ghost is promoted to the LRU list (Am). A long scan
+        passes through the FIFO and leaves Am alone.
+
+  arc - blocks seen once are on the recent list (T1) and blocks seen more
+        than once are on the frequent list (T2). Each has a ghost list (B1,
+        B2) of keys evicted from it. A hit on a ghost moves the target size
+        of T1 towards the list which would have kept the block.
+
+  All sizes are in bytes. Ghosts hold no data and live in their own table.
+
+  A hit does not move the block. It only sets the block's referenced bit,
+  which the policy looks at once the block reaches the cold end of its list
+  (as in CLOCK): under lru the block goes back to the front, under 2q a
+  block in Am goes back to the front of Am, and under arc a block in either
+  list goes to the front of T2. Hits therefore never write to the lists, and
+  can be served with the lock held shared.
+
+  None of the functions here lock, the callers in myfs.c hold cache->lock,
+  shared for myfs_cache_get and exclusively for everything else.
+ */
+
+typedef enum { CACHE_LRU, CACHE_2Q, CACHE_ARC } myfs_cache_policy_t;
+
+static const char *cache_policy_names[] = { "lru", "2q", "arc" };
+
+#define CACHE_DEFAULT_POLICY CACHE_ARC
+
+typedef struct _myfs_lookups_
+{
+  struct _myfs_lookups_ *next;
+
+  unsigned long hits;
+  unsigned long misses;
+
+} myfs_lookups_t;
+
+typedef struct
+{
+  myfs_cache_policy_t policy;
+  size_t capacity;
+
+  myfs_hashtable_t *hashtable;
+  myfs_hashtable_t *ghosts;
+
+  myfs_node_t recent;           /* lru: the list, 2q: A1in, arc: T1 */
+  myfs_node_t frequent;         /* 2q: Am, arc: T2 */
+  myfs_node_t recent_ghosts;    /* 2q: A1out, arc: B1 */
+  myfs_node_t frequent_ghosts;  /* arc: B2 */
+
+  size_t target;                /* arc: the size T1 aims for */
+
+  myfs_node_t dirty;
+  size_t dirty_bytes;
+
+  // Each thread's lookup counts, see myfs_cache_lookups
+  pthread_key_t lookups_key;
+  myfs_lookups_t *lookups;
+  pthread_mutex_t lookups_lock;
+
+  struct {
+    unsigned long ghost_hits;
+    unsigned long evictions;
+    unsigned long write_backs;
+  } stats;
+
+  pthread_rwlock_t lock;
+
+} myfs_cache_t;
+
+myfs_cache_t *myfs_mk_cache(myfs_cache_policy_t policy, size_t capacity)
+{
+  myfs_cache_t *cache = calloc(1, sizeof(myfs_cache_t));
+
+  cache->policy = policy;
+  cache->capacity = capacity;
+
+  cache->hashtable = myfs_mk_hashtable();
+  cache->ghosts = myfs_mk_hashtable();
+
+  myfs_init_root(&(cache->recent));
+  myfs_init_root(&(cache->frequent));
+  myfs_init_root(&(cache->recent_ghosts));
+  myfs_init_root(&(cache->frequent_ghosts));
+  myfs_init_root(&(cache->dirty));
+
+  pthread_key_create(&(cache->lookups_key), NULL);
+  pthread_mutex_init(&(cache->lookups_lock), NULL);
+
+  pthread_rwlock_init(&(cache->lock), NULL);
+
+  return cache;
+}
+
+/*
+  The calling thread's lookup counts. Every thread counts its own, so that
+  lookups sharing a shard don't contend on its counters, and they are
+  summed when read.
+ */
+myfs_lookups_t *myfs_cache_lookups(myfs_cache_t *cache)
+{
+  myfs_lookups_t *lookups = pthread_getspecific(cache->lookups_key);
+
+  if (!lookups) {
+
+    lookups = calloc(1, sizeof(myfs_lookups_t));
+
+    pthread_mutex_lock(&(cache->lookups_lock));
+    lookups->next = cache->lookups;
+    cache->lookups = lookups;
+    pthread_mutex_unlock(&(cache->lookups_lock));
+
+    pthread_setspecific(cache->lookups_key, lookups);
+  }
+
+  return lookups;
+}
+
+/*
+  Looks a block up, counting the hit or miss and marking the block referenced
+ */
+myfs_node_t *myfs_cache_get(myfs_cache_t *cache, uuid_t key)
+{
+  myfs_node_t *node = myfs_hashtable_get(cache->hashtable, key);
+
+  myfs_lookups_t *lookups = myfs_cache_lookups(cache);
+
+  // Only this thread writes them, a reader may sum them at any time
+  if (!node) {
+    __atomic_store_n(&(lookups->misses), lookups->misses + 1, __ATOMIC_RELAXED);
+    return NULL;
+  }
+
+  __atomic_store_n(&(lookups->hits), lookups->hits + 1, __ATOMIC_RELAXED);
+
+  // Hot blocks are already marked, so they are only read
+  if (!__atomic_load_n(&(node->referenced), __ATOMIC_RELAXED))
+    __atomic_store_n(&(node->referenced), true, __ATOMIC_RELAXED);
+
+  return node;
+}
+
+/*
+  Marks a node dirty, putting it at the tail of the dirty list. A node which is
+  already dirty keeps its place, so the head is always the oldest dirty node.
+ */
+void myfs_node_dirty(myfs_cache_t *cache, myfs_node_t *node)
+{
+  if (node->dirty)
+    return;
+
+  node->dirty = true;
+  node->dirtied = time(0);
+
+  node->dirty_prev = cache->dirty.dirty_prev;
+  node->dirty_next = &(cache->dirty);
+
+  cache->dirty.dirty_prev->dirty_next = node;
+  cache->dirty.dirty_prev = node;
+
+  cache->dirty_bytes += node->size;
+}
+
+void myfs_node_clean(myfs_cache_t *cache, myfs_node_t *node)
 {
-  myfs_hashtable_del(hashtable, to_be_evicted->key);
-  myfs_queue_rem(to_be_evicted);
-  myfs_rm_node(to_be_evicted);
+  if (!node->dirty)
+    return;
+
+  node->dirty = false;
+
+  node->dirty_next->dirty_prev = node->dirty_prev;
+  node->dirty_prev->dirty_next = node->dirty_next;
+
+  cache->dirty_bytes -= node->size;
 }
 
 int db_put(uuid_t key, void *data, size_t size);
+int db_put_node(myfs_node_t *node);
 int db_get(uuid_t key, void *data, unqlite_int64 size);
+void *db_get_alloc(uuid_t key, unqlite_int64 *size);
 
-void flush_cache(myfs_node_t *root)
+/*
+  Writes a dirty node back to the store, leaving it cached
+ */
+void cache_write_back(myfs_cache_t *cache, myfs_node_t *node)
 {
-  myfs_node_t *c = root;
-  
-  while((c = c->next) != root)
-    db_put(c->key, c->data, c->size);
-    
+  db_put_node(node);
+  myfs_node_clean(cache, node);
+
+  cache->stats.write_backs++;
+}
+
+static void cache_drop_ghost(myfs_cache_t *cache, myfs_node_t *ghost)
+{
+  myfs_hashtable_del(cache->ghosts, ghost->key);
+  myfs_list_rem(ghost);
+  myfs_rm_node(ghost);
+}
+
+/*
+  2Q remembers half a cache worth of ghosts. ARC keeps T1 and B1 within the
+  cache size, and all four lists within twice that.
+ */
+static void cache_trim_ghosts(myfs_cache_t *cache)
+{
+  myfs_node_t *b1 = &(cache->recent_ghosts);
+  myfs_node_t *b2 = &(cache->frequent_ghosts);
+
+  if (cache->policy == CACHE_2Q) {
+
+    while (b1->size > cache->capacity / 2)
+      cache_drop_ghost(cache, b1->prev);
+
+  } else if (cache->policy == CACHE_ARC) {
+
+    while (b1->next != b1 && cache->recent.size + b1->size > cache->capacity)
+      cache_drop_ghost(cache, b1->prev);
+
+    while (b2->next != b2 && cache->hashtable->bytes + b1->size + b2->size > 2 * cache->capacity)
+      cache_drop_ghost(cache, b2->prev);
+  }
+}
+
+/*
+  The block at the cold end of the list the policy evicts from next
+ */
+static myfs_node_t *cache_candidate(myfs_cache_t *cache)
+{
+  myfs_node_t *recent = &(cache->recent);
+  myfs_node_t *frequent = &(cache->frequent);
+
+  switch (cache->policy) {
+  case CACHE_2Q:
+    // A1in is kept to a quarter of the cache
+    if (frequent->next == frequent || recent->size > cache->capacity / 4)
+      return recent->prev;
+
+    return frequent->prev;
+
+  case CACHE_ARC:
+    if (recent->next != recent && (frequent->next == frequent || recent->size > cache->target))
+      return recent->prev;
+
+    return frequent->prev;
+
+  default:
+    return recent->prev;
+  }
+}
+
+/*
+  Picks the block to evict next. Blocks which were hit since they were last
+  looked at are moved on as the policy asks, and the next one is tried.
+ */
+static myfs_node_t *cache_victim(myfs_cache_t *cache)
+{
+  while (true) {
+
+    myfs_node_t *node = cache_candidate(cache);
+
+    // A hit in A1in leaves the block where it is
+    if (!node->referenced || (cache->policy == CACHE_2Q && node->list == &(cache->recent)))
+      return node;
+
+    node->referenced = false;
+
+    myfs_node_t *list = cache->policy == CACHE_LRU ? &(cache->recent) : &(cache->frequent);
+
+    myfs_list_rem(node);
+    myfs_list_add(list, node);
+  }
+}
+
+/*
+  Drops a node from the cache. Only a dirty node has to be written first, and
+  the policy may remember its key as a ghost.
+ */
+void cache_evict(myfs_cache_t *cache, myfs_node_t *to_be_evicted)
+{
+  if (to_be_evicted->dirty)
+    cache_write_back(cache, to_be_evicted);
+
+  myfs_node_t *list = to_be_evicted->list;
+
+  myfs_hashtable_del(cache->hashtable, to_be_evicted->key);
+  myfs_list_rem(to_be_evicted);
+
+  cache->stats.evictions++;
+
+  if (cache->policy == CACHE_LRU || (cache->policy == CACHE_2Q && list == &(cache->frequent))) {
+    myfs_rm_node(to_be_evicted);
+    return;
+  }
+
+  myfs_rm_frame(to_be_evicted);
+
+  to_be_evicted->referenced = false;
+
+  myfs_hashtable_put(cache->ghosts, to_be_evicted);
+  myfs_list_add(list == &(cache->recent) ? &(cache->recent_ghosts) : &(cache->frequent_ghosts), to_be_evicted);
+
+  cache_trim_ghosts(cache);
+}
+
+/*
+  Adds a block which missed, evicting until it fits. A block whose key is
+  still remembered as a ghost goes straight to the frequent list.
+ */
+void cache_insert(myfs_cache_t *cache, myfs_node_t *node)
+{
+  myfs_node_t *list = &(cache->recent);
+  myfs_node_t *ghost = myfs_hashtable_get(cache->ghosts, node->key);
+
+  if (ghost) {
+
+    cache->stats.ghost_hits++;
+
+    if (cache->policy == CACHE_ARC) {
+
+      size_t b1 = cache->recent_ghosts.size;
+      size_t b2 = cache->frequent_ghosts.size;
+
+      // Grow T1 on a hit in B1, shrink it on a hit in B2
+      if (ghost->list == &(cache->recent_ghosts)) {
+	size_t delta = (b2 > b1 ? b2 / b1 : 1) * node->size;
+	cache->target = cache->target + delta < cache->capacity ? cache->target + delta : cache->capacity;
+      } else {
+	size_t delta = (b1 > b2 ? b1 / b2 : 1) * node->size;
+	cache->target = cache->target > delta ? cache->target - delta : 0;
+      }
+    }
+
+    cache_drop_ghost(cache, ghost);
+
+    list = &(cache->frequent);
+  }
+
+  // Evict until the new node fits in the budget
+  while (cache->hashtable->s && cache->hashtable->bytes + node->size > cache->capacity)
+    cache_evict(cache, cache_victim(cache));
+
+  myfs_list_add(list, node);
+  myfs_hashtable_put(cache->hashtable, node);
+}
+
+/*
+  Forgets a block which is being deleted, without writing it back
+ */
+void cache_discard(myfs_cache_t *cache, uuid_t key)
+{
+  myfs_node_t *node = myfs_hashtable_get(cache->hashtable, key);
+
+  if (node) {
+    myfs_node_clean(cache, node);
+    myfs_hashtable_del(cache->hashtable, key);
+    myfs_list_rem(node);
+    myfs_rm_node(node);
+  }
+
+  node = myfs_hashtable_get(cache->ghosts, key);
+
+  if (node)
+    cache_drop_ghost(cache, node);
+}
+
+void flush_cache(myfs_cache_t *cache)
+{
+  while (cache->dirty.dirty_next != &(cache->dirty))
+    cache_write_back(cache, cache->dirty.dirty_next);
+}
+
+
+/*
+  Sharded Cache
+
+  A cache is split into shards, each a myfs_cache_t with its own lock, its
+  own share of the capacity and its own replacement state. A block always
+  lives in the shard picked by the top bits of the hash of its key (the low
+  bits pick its bucket within the shard). A cache too small to give every
+  shard SHARD_MIN_OBJECTS objects has fewer shards.
+ */
+
+#define CACHE_SHARDS 16
+
+#define SHARD_MIN_OBJECTS 64
+
+typedef struct
+{
+  int count;
+  int bits;
+
+  myfs_cache_t *shards[CACHE_SHARDS];
+
+} myfs_shards_t;
+
+myfs_shards_t *myfs_mk_shards(myfs_cache_policy_t policy, size_t capacity, size_t object_size)
+{
+  myfs_shards_t *shards = calloc(1, sizeof(myfs_shards_t));
+
+  shards->bits = __builtin_ctz(CACHE_SHARDS);
+
+  while (shards->bits && capacity >> shards->bits < SHARD_MIN_OBJECTS * object_size)
+    shards->bits--;
+
+  shards->count = 1 << shards->bits;
+
+  for (int i = 0; i < shards->count; i++)
+    shards->shards[i] = myfs_mk_cache(policy, capacity / shards->count);
+
+  return shards;
+}
+
+myfs_cache_t *myfs_shard(myfs_shards_t *shards, uuid_t key)
+{
+  if (!shards->bits)
+    return shards->shards[0];
+
+  return shards->shards[hash(key) >> (32 - shards->bits)];
+}
+
+void cache_report(myfs_shards_t *shards, const char *name, FILE *f)
+{
+  unsigned long hits = 0, misses = 0, ghost_hits = 0, evictions = 0, write_backs = 0;
+
+  for (int i = 0; i < shards->count; i++) {
+
+    myfs_cache_t *shard = shards->shards[i];
+
+    pthread_mutex_lock(&(shard->lookups_lock));
+
+    for (myfs_lookups_t *lookups = shard->lookups; lookups; lookups = lookups->next) {
+      hits += __atomic_load_n(&(lookups->hits), __ATOMIC_RELAXED);
+      misses += __atomic_load_n(&(lookups->misses), __ATOMIC_RELAXED);
+    }
+
+    pthread_mutex_unlock(&(shard->lookups_lock));
+
+    ghost_hits += shard->stats.ghost_hits;
+    evictions += shard->stats.evictions;
+    write_backs += shard->stats.write_backs;
+  }
+
+  fprintf(f, "%s: policy %s, %d shards, %lu hits, %lu misses, %lu ghost hits, %lu evictions, %lu write backs\n",
+	  name, cache_policy_names[shards->shards[0]->policy], shards->count,
+	  hits, misses, ghost_hits, evictions, write_backs);
+}
+
+
+/*
+  Dentry Cache
+
+  Maps a full path onto the uuid and fcb it resolves to, so that hot paths
+  can be resolved without walking the directory tree in the store. Negative
+  entries remember paths which are known not to exist. An entry may be
+  evicted as soon as the lock is dropped, so lookups hand back a copy.
+ */
+
+#define DCACHE_TABLE_SIZE 4096
+
+#define DCACHE_EVICT_SIZE 16384
+
+typedef struct _myfs_dentry_
+{
+  struct _myfs_dentry_ *next;
+  struct _myfs_dentry_ *prev;
+
+  struct _myfs_dentry_ *chain;
+
+  unsigned int hash;
+  bool negative;
+
+  uuid_t uuid;
+  myfcb fcb;
+
+  char *path;
+  
+} myfs_dentry_t;
+
+typedef struct
+{
+  int s;
+  myfs_dentry_t root;
+  myfs_dentry_t *buckets[DCACHE_TABLE_SIZE];
+
+  pthread_mutex_t lock;
+
+} myfs_dcache_t;
+
+/*
+  djb2 by Dan Bernstein
+ */
+unsigned int hash_string(const char *s)
+{
+  unsigned int h = 5381;
+
+  while (*s)
+    h = ((h << 5) + h) + (unsigned char) *s++;
+
+  return h;
+}
+
+myfs_dcache_t *myfs_mk_dcache()
+{
+  myfs_dcache_t *dcache = calloc(1, sizeof(myfs_dcache_t));
+  dcache->root.next = dcache->root.prev = &(dcache->root);
+
+  pthread_mutex_init(&(dcache->lock), NULL);
+
+  return dcache;
+}
+
+myfs_dentry_t *myfs_dcache_get(myfs_dcache_t *dcache, const char *path)
+{
+  unsigned int h = hash_string(path);
+  myfs_dentry_t *c = dcache->buckets[h % DCACHE_TABLE_SIZE];
+
+  for (; c; c = c->chain) {
+
+    if (c->hash == h && strcmp(c->path, path) == 0) {
+
+      // Move found entry to the front of the LRU list
+      c->prev->next = c->next;
+      c->next->prev = c->prev;
+
+      c->next = dcache->root.next;
+      c->prev = &(dcache->root);
+      dcache->root.next->prev = c;
+      dcache->root.next = c;
+
+      return c;
+    }
+  }
+
+  return NULL;
+}
+
+static void myfs_dcache_free(myfs_dcache_t *dcache, myfs_dentry_t *dentry)
+{
+  myfs_dentry_t **c = &(dcache->buckets[dentry->hash % DCACHE_TABLE_SIZE]);
+
+  while (*c != dentry)
+    c = &((*c)->chain);
+
+  *c = dentry->chain;
+
+  dentry->prev->next = dentry->next;
+  dentry->next->prev = dentry->prev;
+
+  dcache->s--;
+
+  free(dentry->path);
+  free(dentry);
+}
+
+static myfs_dentry_t *myfs_dcache_add(myfs_dcache_t *dcache, const char *path)
+{
+  myfs_dentry_t *dentry = myfs_dcache_get(dcache, path);
+
+  if (dentry)
+    return dentry;
+
+  if (dcache->s >= DCACHE_EVICT_SIZE)
+    myfs_dcache_free(dcache, dcache->root.prev);
+
+  dentry = calloc(1, sizeof(myfs_dentry_t));
+  dentry->path = strdup(path);
+  dentry->hash = hash_string(path);
+
+  dentry->chain = dcache->buckets[dentry->hash % DCACHE_TABLE_SIZE];
+  dcache->buckets[dentry->hash % DCACHE_TABLE_SIZE] = dentry;
+
+  dentry->next = dcache->root.next;
+  dentry->prev = &(dcache->root);
+  dcache->root.next->prev = dentry;
+  dcache->root.next = dentry;
+
+  dcache->s++;
+
+  return dentry;
+}
+
+/*
+  Copies out the entry for a path, false if there is none
+ */
+bool myfs_dcache_lookup(myfs_dcache_t *dcache, const char *path, myfs_dentry_t *copy)
+{
+  pthread_mutex_lock(&(dcache->lock));
+
+  myfs_dentry_t *dentry = myfs_dcache_get(dcache, path);
+
+  if (dentry) {
+    copy->negative = dentry->negative;
+    uuid_copy(copy->uuid, dentry->uuid);
+    copy->fcb = dentry->fcb;
+  }
+
+  pthread_mutex_unlock(&(dcache->lock));
+
+  return dentry != NULL;
+}
+
+void myfs_dcache_put(myfs_dcache_t *dcache, const char *path, uuid_t uuid, myfcb *fcb)
+{
+  pthread_mutex_lock(&(dcache->lock));
+
+  myfs_dentry_t *dentry = myfs_dcache_add(dcache, path);
+
+  dentry->negative = false;
+  uuid_copy(dentry->uuid, uuid);
+  dentry->fcb = *fcb;
+
+  pthread_mutex_unlock(&(dcache->lock));
+}
+
+void myfs_dcache_put_negative(myfs_dcache_t *dcache, const char *path)
+{
+  pthread_mutex_lock(&(dcache->lock));
+
+  myfs_dentry_t *dentry = myfs_dcache_add(dcache, path);
+
+  dentry->negative = true;
+  uuid_clear(dentry->uuid);
+  memset(&(dentry->fcb), 0, sizeof(myfcb));
+
+  pthread_mutex_unlock(&(dcache->lock));
+}
+
+
+/*
+  Open File Handles
+
+  A handle is stored in fuse_file_info->fh between open and release and
+  holds the resolved fcb together with copies of its indirect blocks, so
+  that reads and writes need not resolve the path again. Opening a file
+  which is already open shares the existing handle, so every opener sees
+  the same fcb. Handles are linked on a list and indexed by uuid in a
+  hashtable of their own, so finding the handle of a file costs the same
+  however many files are open. The list, the index and each handle's refs
+  are guarded by the handles' lock, or by holding fs_lock alone.
+
+  The handle's lock is the per-inode lock: reads share it, writes hold it
+  alone. Readers still share the copies of the block map, so filling those
+  in is done under map_lock.
+ */
+
+typedef struct _myfs_handle_
+{
+  struct _myfs_handle_ *next;
+  struct _myfs_handle_ *prev;
+
+  // Keyed by uuid in the index, with data pointing back at the handle
+  myfs_node_t node;
+
+  int refs;
+  bool dirty;
+  bool unlinked;
+
+  uuid_t uuid;
+  myfcb fcb;
+
+  bool singley_cached;
+  indirect_block_t singley;
+
+  bool doubley_cached;
+  indirect_block_t doubley;
+
+  int doubley_index;
+  indirect_block_t doubley_s;
+
+  int tripley_index;
+  indirect_block_t tripley_s;
+
+  // The file's extents once they have been looked at. A list which has
+  // outgrown the fcb is only written back with the fcb (see
+  // put_handle_extents), spilled says whether the store has a copy of it.
+  extent_t *extents;
+  bool extents_dirty;
+  bool extents_spilled;
+
+  pthread_rwlock_t lock;
+  pthread_mutex_t map_lock;
+  
+} myfs_handle_t;
+
+typedef struct
+{
+  myfs_handle_t root;
+  myfs_hashtable_t *index;
+
+  pthread_mutex_t lock;
+
+} myfs_handles_t;
+
+myfs_handles_t *myfs_mk_handles()
+{
+  myfs_handles_t *handles = calloc(1, sizeof(myfs_handles_t));
+  handles->root.next = handles->root.prev = &(handles->root);
+
+  handles->index = myfs_mk_hashtable();
+
+  pthread_mutex_init(&(handles->lock), NULL);
+
+  return handles;
+}
+
+myfs_handle_t *myfs_handles_get(myfs_handles_t *handles, uuid_t uuid)
+{
+  myfs_node_t *node = myfs_hashtable_get(handles->index, uuid);
+
+  return node ? node->data : NULL;
+}
+
+void myfs_handles_add(myfs_handles_t *handles, myfs_handle_t *handle)
+{
+  myfs_handle_t *root = &(handles->root);
+
+  handle->next = root->next;
+  handle->prev = root;
+
+  root->next->prev = handle;
+
+  root->next = handle;
+
+  uuid_copy(handle->node.key, handle->uuid);
+  handle->node.data = handle;
+
+  myfs_hashtable_put(handles->index, &(handle->node));
+}
+
+void myfs_handles_rem(myfs_handles_t *handles, myfs_handle_t *handle)
+{
+  handle->next->prev = handle->prev;
+  handle->prev->next = handle->next;
+
+  myfs_hashtable_del(handles->index, handle->uuid);
+}
+
+/*
+  Forgets the cached indirect blocks, they must be refetched after the block
+  map changes. The extents are the handle's own and stay.
+ */
+void myfs_handle_invalidate(myfs_handle_t *handle)
+{
+  handle->singley_cached = false;
+  handle->doubley_cached = false;
+  handle->doubley_index = -1;
+  handle->tripley_index = -1;
+}
+
+
+/*
+  Reaper
+
+  Blocks which are no longer needed are queued here as runs of keys and
+  deleted a batch at a time, so that removing a large file needn't wait for
+  every one of its blocks to go. The keys of run r are derive_key(r->base, n)
+  for n in [r->first, r->first + r->count), so a single key is a run of one
+  starting at 0.
+ */
+
+typedef struct _myfs_reap_
+{
+  struct _myfs_reap_ *next;
+
+  uuid_t base;
+  uint64_t first;
+  uint64_t count;
+  
+} myfs_reap_t;
+
+typedef struct
+{
+  myfs_reap_t *head;
+  myfs_reap_t *tail;
+
+  uint64_t blocks;
+
+} myfs_reaper_t;
+
+// A run as the record of orphans keeps it, see orphans_write
+typedef struct __attribute__((packed))
+{
+  uuid_t base;
+  uint64_t first;
+  uint64_t count;
+
+} myfs_packed_reap_t;
+
+void myfs_reaper_add(myfs_reaper_t *reaper, uuid_t base, uint64_t first, uint64_t count)
+{
+  myfs_reap_t *tail = reaper->tail;
+
+  reaper->blocks += count;
+
+  // Runs which carry on from the last are merged into it
+  if (tail && uuid_compare(tail->base, base) == 0 && tail->first + tail->count == first) {
+    tail->count += count;
+    return;
+  }
+
+  myfs_reap_t *reap = calloc(1, sizeof(myfs_reap_t));
+
+  uuid_copy(reap->base, base);
+  reap->first = first;
+  reap->count = count;
+
+  if (tail)
+    tail->next = reap;
+  else
+    reaper->head = reap;
+
+  reaper->tail = reap;
+}
+
+/*
+  Moves every run queued on one reaper onto the end of another
+ */
+void myfs_reaper_splice(myfs_reaper_t *reaper, myfs_reaper_t *from)
+{
+  if (!from->head)
+    return;
+
+  if (reaper->tail)
+    reaper->tail->next = from->head;
+  else
+    reaper->head = from->head;
+
+  reaper->tail = from->tail;
+  reaper->blocks += from->blocks;
+
+  memset(from, 0, sizeof(myfs_reaper_t));
+}
+
+void derive_key(uuid_t base, uint64_t n, uuid_t key);
+
+/*
+  Takes the next key off the queue, false once it is empty
+ */
+bool myfs_reaper_next(myfs_reaper_t *reaper, uuid_t key)
+{
+  myfs_reap_t *head = reaper->head;
+
+  if (!head)
+    return false;
+
+  derive_key(head->base, head->first, key);
+
+  head->first++;
+  reaper->blocks--;
+
+  if (!--head->count) {
+
+    reaper->head = head->next;
+
+    if (!reaper->head)
+      reaper->tail = NULL;
+
+    free(head);
+  }
+
+  return true;
+}
+
+
+/*
+  Data File Allocator
+
+  Keeps a bit for each block of the data file, set while the block is in
+  use. The bitmap is kept in the store a chunk (one block, mapping
+  ALLOC_CHUNK_BLOCKS blocks) per record, and grows a chunk at a time. Chunks
+  which changed are written with the next commit, so the bitmap in the
+  store always agrees with the extents which were committed alongside it.
+
+  A block which is freed can't be handed out again until the free has been
+  committed. Until then the last committed extents may still map it, and
+  after a crash they would find it holding somebody else's data. Such
+  blocks are marked in freed, which myfs_alloc_settle clears after a commit.
+ */
+
+#define ALLOC_CHUNK_BLOCKS (BLOCK_SIZE * 8)
+#define ALLOC_CHUNK_WORDS (ALLOC_CHUNK_BLOCKS / 64)
+
+#define ALLOC_NO_GOAL UINT64_MAX
+
+typedef struct
+{
+  uint64_t *used;
+  uint64_t *freed;
+
+  // One flag per chunk, whether it has changed since the last commit
+  bool *dirty;
+
+  uint64_t chunks;
+
+  // Where the last run given out ended, the search starts there for ALLOC_NO_GOAL
+  uint64_t next;
+
+} myfs_alloc_t;
+
+void myfs_alloc_grow(myfs_alloc_t *alloc, uint64_t chunks)
+{
+  if (chunks <= alloc->chunks)
+    return;
+
+  size_t words = chunks * ALLOC_CHUNK_WORDS, old = alloc->chunks * ALLOC_CHUNK_WORDS;
+
+  alloc->used = realloc(alloc->used, words * sizeof(uint64_t));
+  alloc->freed = realloc(alloc->freed, words * sizeof(uint64_t));
+  alloc->dirty = realloc(alloc->dirty, chunks * sizeof(bool));
+
+  memset(alloc->used + old, 0, (words - old) * sizeof(uint64_t));
+  memset(alloc->freed + old, 0, (words - old) * sizeof(uint64_t));
+
+  // A new chunk must reach the store even if nothing in it is used
+  memset(alloc->dirty + alloc->chunks, true, (chunks - alloc->chunks) * sizeof(bool));
+
+  alloc->chunks = chunks;
+}
+
+static bool myfs_alloc_busy(myfs_alloc_t *alloc, uint64_t block)
+{
+  return ((alloc->used[block / 64] | alloc->freed[block / 64]) >> (block % 64)) & 1;
+}
+
+/*
+  The first block at or after from which can be handed out, or the end of the bitmap
+ */
+static uint64_t myfs_alloc_search(myfs_alloc_t *alloc, uint64_t from)
+{
+  uint64_t end = alloc->chunks * ALLOC_CHUNK_BLOCKS;
+
+  while (from < end) {
+
+    // Whole words in use are passed over at once
+    if (from % 64 == 0 && ~(alloc->used[from / 64] | alloc->freed[from / 64]) == 0) {
+      from += 64;
+      continue;
+    }
+
+    if (!myfs_alloc_busy(alloc, from))
+      return from;
+
+    from++;
+  }
+
+  return end;
+}
+
+/*
+  Gives out a run of up to want free blocks, as near after goal as can be,
+  and returns its first block. The length given is left in got. The bitmap
+  grows when there is nothing free.
+ */
+uint64_t myfs_alloc_run(myfs_alloc_t *alloc, uint64_t goal, uint64_t want, uint64_t *got)
+{
+  uint64_t end = alloc->chunks * ALLOC_CHUNK_BLOCKS;
+
+  if (goal == ALLOC_NO_GOAL)
+    goal = alloc->next;
+
+  uint64_t first = myfs_alloc_search(alloc, goal < end ? goal : end);
+
+  if (first == end)
+    first = myfs_alloc_search(alloc, 0);
+
+  if (first == end)
+    myfs_alloc_grow(alloc, alloc->chunks + 1);
+
+  end = alloc->chunks * ALLOC_CHUNK_BLOCKS;
+
+  uint64_t n = 0;
+
+  while (n < want && first + n < end && !myfs_alloc_busy(alloc, first + n)) {
+
+    uint64_t block = first + n++;
+
+    alloc->used[block / 64] |= 1ULL << (block % 64);
+    alloc->dirty[block / ALLOC_CHUNK_BLOCKS] = true;
+  }
+
+  alloc->next = first + n;
+
+  *got = n;
+
+  return first;
+}
+
+void myfs_alloc_free(myfs_alloc_t *alloc, uint64_t block)
+{
+  if (block >= alloc->chunks * ALLOC_CHUNK_BLOCKS)
+    return;
+
+  alloc->used[block / 64] &= ~(1ULL << (block % 64));
+  alloc->freed[block / 64] |= 1ULL << (block % 64);
+  alloc->dirty[block / ALLOC_CHUNK_BLOCKS] = true;
+}
+
+/*
+  Takes back a run given out by myfs_alloc_run which was never mapped, so
+  that it can be handed out again straight away
+ */
+void myfs_alloc_return(myfs_alloc_t *alloc, uint64_t first, uint64_t count)
+{
+  for (uint64_t block = first; block < first + count; block++)
+    alloc->used[block / 64] &= ~(1ULL << (block % 64));
+
+  alloc->next = first;
+}
+
+/*
+  Lets the blocks freed before a commit be handed out again
+ */
+void myfs_alloc_settle(myfs_alloc_t *alloc)
+{
+  if (alloc->chunks)
+    memset(alloc->freed, 0, alloc->chunks * ALLOC_CHUNK_WORDS * sizeof(uint64_t));
+}
+
+
+/*
+  Log
+
+  Blocks of files with the log layout are appended, in whatever order they
+  are written, to the segment at the head of the log. A segment is
+  SEGMENT_BLOCKS slots followed by its summary, which holds the key of the
+  block written to each slot. The store maps each key to the segment and
+  slot holding its latest copy, so overwriting or removing a block leaves
+  a dead slot behind. A full segment whose share of live slots has fallen
+  below a threshold is cleaned: its live blocks are appended again at the
+  head, and once that has been committed the segment is free to be reused.
+ */
+
+#define SEGMENT_BLOCKS 1024
+#define SUMMARY_BLOCKS (SEGMENT_BLOCKS * KEY_SIZE / BLOCK_SIZE)
+#define SEGMENT_SIZE ((off_t) (SEGMENT_BLOCKS + SUMMARY_BLOCKS) * BLOCK_SIZE)
+
+#define NO_SEGMENT UINT32_MAX
+
+typedef struct
+{
+  // Slots written so far, SEGMENT_BLOCKS once the segment is full, 0 if it is free
+  uint32_t used;
+
+  // Slots holding the latest copy of their block
+  uint32_t live;
+
+} myfs_segment_t;
+
+typedef struct
+{
+  uint32_t count;
+  uint32_t head;
+
+  myfs_segment_t *segments;
+
+  // Segments which have been cleaned, free once the clean is committed
+  bool *cleaned;
+
+  // The summary of the head segment, written out when it fills or on commit
+  uuid_t summary[SEGMENT_BLOCKS];
+
+  // Whether the segments have changed since they were last written to the store
+  bool dirty;
+
+  struct
+  {
+    unsigned long appended;
+    unsigned long relocated;
+    unsigned long cleaned;
+
+  } stats;
+
+} myfs_log_t;
+
+void myfs_log_grow(myfs_log_t *log, uint32_t count)
+{
+  if (count <= log->count)
+    return;
+
+  log->segments = realloc(log->segments, count * sizeof(myfs_segment_t));
+  log->cleaned = realloc(log->cleaned, count * sizeof(bool));
+
+  memset(log->segments + log->count, 0, (count - log->count) * sizeof(myfs_segment_t));
+  memset(log->cleaned + log->count, 0, (count - log->count) * sizeof(bool));
+
+  log->count = count;
+}
+
+/*
+  Moves the head to the first free segment, adding one at the end if there is none
+ */
+void myfs_log_next_head(myfs_log_t *log)
+{
+  uint32_t s = 0;
+
+  while (s < log->count && (log->segments[s].used || log->cleaned[s]))
+    s++;
+
+  myfs_log_grow(log, s + 1);
+
+  log->head = s;
+  log->dirty = true;
+
+  memset(log->summary, 0, sizeof(log->summary));
+}
+
+/*
+  The full segment with the fewest live slots, if that is under threshold
+  percent of them, otherwise NO_SEGMENT
+ */
+uint32_t myfs_log_victim(myfs_log_t *log, unsigned int threshold)
+{
+  uint32_t victim = NO_SEGMENT;
+
+  for (uint32_t s = 0; s < log->count; s++) {
+
+    myfs_segment_t *segment = &(log->segments[s]);
+
+    if (s == log->head || log->cleaned[s] || segment->used < SEGMENT_BLOCKS)
+      continue;
+
+    if ((uint64_t) segment->live * 100 >= (uint64_t) threshold * SEGMENT_BLOCKS)
+      continue;
+
+    if (victim == NO_SEGMENT || segment->live < log->segments[victim].live)
+      victim = s;
+  }
+
+  return victim;
+}
+
+/*
+  Frees the segments whose cleaning has been committed
+ */
+void myfs_log_settle(myfs_log_t *log)
+{
+  for (uint32_t s = 0; s < log->count; s++) {
+
+    if (!log->cleaned[s])
+      continue;
+
+    log->segments[s].used = 0;
+    log->segments[s].live = 0;
+    log->cleaned[s] = false;
+  }
 }
@@ -57074,10 +57074,12 @@ static int pager_write_hot_dirty_pages(Pager *pPager,Page *pDirty)
 		}else{
 			pPager->pFirstDirty = pDirty->pDirtyPrev;
 		}
-		/* Discard */
-		pager_unlink_page(pPager,pDirty);
-		/* Release the page */
-		pager_release_page(pPager,pDirty);
+		if( pDirty->nRef < 1 ){
+			/* Discard */
+			pager_unlink_page(pPager,pDirty);
+			/* Release the page */
+			pager_release_page(pPager,pDirty);
+		}
 		/* Next hot page */
 		pDirty = pNext;
 	}
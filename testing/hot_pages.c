@@ -0,0 +1,105 @@
+/*
+  Reproducer for the UnQLite pager releasing hot dirty pages which are still
+  referenced.
+
+  A record's overflow pages are dirty and unreferenced, so the pager keeps them
+  on its hot list. Deleting the record puts those pages on the free list, and
+  later bucket splits take them back as bucket pages. A lookup keeps its bucket
+  page referenced, but the page stays on the hot list. Once more than 127 hot
+  pages pile up, the next write flushes the list and used to release every page
+  on it, so the hash engine went on using freed pages and records were lost.
+
+  gcc -I../code -o hot_pages hot_pages.c ../code/unqlite.c -pthread -lm
+  ./hot_pages
+*/
+
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "unqlite.h"
+
+#define DB "hot_pages.db"
+
+#define BIG 4096
+#define SMALL 312
+
+#define BIG_RECORDS 60
+#define SMALL_RECORDS 100
+#define MORE_RECORDS 300
+
+static char buf[BIG], got[BIG];
+
+static void store(unqlite *db, const char *prefix, int i, int c, int size)
+{
+  char key[32];
+  snprintf(key, sizeof(key), "%s%d", prefix, i);
+  memset(buf, c, size);
+  unqlite_kv_store(db, key, -1, buf, size);
+}
+
+static int check(unqlite *db, const char *prefix, int i, int c, int size)
+{
+  char key[32];
+  unqlite_int64 n = sizeof(got);
+  snprintf(key, sizeof(key), "%s%d", prefix, i);
+  memset(buf, c, size);
+  return unqlite_kv_fetch(db, key, -1, got, &n) == UNQLITE_OK && n == size && memcmp(got, buf, n) == 0;
+}
+
+int main(int argc, char** argv)
+{
+  unqlite *db;
+  int i, j, bad = 0;
+
+  unlink(DB);
+  if (unqlite_open(&db, DB, UNQLITE_OPEN_CREATE) != UNQLITE_OK) {
+    return 2;
+  }
+
+  // Hot overflow pages, handed to the free list
+  for (i = 0; i < BIG_RECORDS; i++) {
+    store(db, "big", i, 'b', BIG);
+  }
+  for (i = 0; i < BIG_RECORDS; i++) {
+    char key[32];
+    snprintf(key, sizeof(key), "big%d", i);
+    unqlite_kv_delete(db, key, -1);
+  }
+
+  // Bucket splits reuse them, and lookups keep them referenced
+  for (i = 0; i < SMALL_RECORDS; i++) {
+    store(db, "small", i, i, SMALL);
+    for (j = 0; j <= i; j++) {
+      check(db, "small", j, j, SMALL);
+    }
+  }
+
+  // Enough hot pages to flush the list, then writes through the stale pages
+  for (i = 0; i < MORE_RECORDS; i++) {
+    store(db, "more", i, 'c', BIG);
+  }
+  for (i = 0; i < SMALL_RECORDS; i++) {
+    store(db, "small", i, i + 1, SMALL);
+  }
+  for (i = 0; i < MORE_RECORDS; i++) {
+    store(db, "last", i, 'd', BIG);
+  }
+  unqlite_close(db);
+
+  if (unqlite_open(&db, DB, UNQLITE_OPEN_CREATE) != UNQLITE_OK) {
+    return 2;
+  }
+  for (i = 0; i < MORE_RECORDS; i++) {
+    bad += !check(db, "more", i, 'c', BIG);
+    bad += !check(db, "last", i, 'd', BIG);
+  }
+  for (i = 0; i < SMALL_RECORDS; i++) {
+    bad += !check(db, "small", i, i + 1, SMALL);
+  }
+  unqlite_close(db);
+  unlink(DB);
+
+  printf("%d records lost or stale\n", bad);
+  return bad != 0;
+}
@@ -0,0 +1,60 @@
+##
+# For tests which need a file system of their own: to mount it with options
+# of their own, or to mount the same store again after an unmount or a crash.
+# Sourced by such tests. The store is kept in a scratch directory, which is
+# removed along with the mount when the test exits.
+##
+
+myfs="$(cd "$(dirname "${BASH_SOURCE[0]}")/../code" && pwd)/myfs"
+
+store="$(mktemp -d)"
+mnt="$store/mnt"
+
+mkdir "$mnt"
+
+# Mounts the store with the options given, and waits until it is mounted.
+# The output of myfs is appended to $store/out.
+function mount_myfs()
+{
+    (cd "$store" && exec "$myfs" -f "$@" "$mnt") >> "$store/out" 2>&1 &
+    pid=$!
+
+    for i in $(seq 1 100); do
+	if mountpoint -q "$mnt"; then
+	    return 0
+	fi
+
+	if ! kill -0 $pid 2>/dev/null; then
+	    return 1
+	fi
+
+	sleep 0.1
+    done
+
+    return 1
+}
+
+# Unmounts cleanly, committing what was written
+function unmount_myfs()
+{
+    fusermount -u "$mnt" && wait $pid
+}
+
+# Stops the file system dead, as a crash would
+function kill_myfs()
+{
+    kill -9 $pid
+    wait $pid 2>/dev/null
+    fusermount -u -z "$mnt"
+}
+
+function cleanup_myfs()
+{
+    if mountpoint -q "$mnt"; then
+	kill_myfs
+    fi
+
+    rm -rf "$store"
+}
+
+trap cleanup_myfs EXIT
@@ -0,0 +1,36 @@
+##
+# Tests sparse files, holes must read back as zeros
+##
+
+if ! truncate -s 1G $1/sparse_file; then
+    exit 1
+fi
+
+if ! printf 'data' | dd of=$1/sparse_file bs=1 seek=500000000 conv=notrunc 2>/dev/null; then
+    exit 1
+fi
+
+if [ "$(stat -c %s $1/sparse_file)" != "1073741824" ]; then
+    exit 1
+fi
+
+if [ "$(dd if=$1/sparse_file bs=4096 skip=1000 count=1 2>/dev/null | tr -d '\0' | wc -c)" != "0" ]; then
+    exit 1
+fi
+
+if [ "$(dd if=$1/sparse_file bs=1 skip=500000000 count=4 2>/dev/null)" != "data" ]; then
+    exit 1
+fi
+
+# Cutting a block in half must not leave its old end behind
+if ! truncate -s 500000002 $1/sparse_file || ! truncate -s 500000004 $1/sparse_file; then
+    exit 1
+fi
+
+if [ "$(dd if=$1/sparse_file bs=1 skip=500000000 count=4 2>/dev/null | tr -d '\0')" != "da" ]; then
+    exit 1
+fi
+
+if ! rm $1/sparse_file; then
+    exit 1
+fi
@@ -0,0 +1,49 @@
+##
+# Tests reading and writing through a file which stays open while it is
+# removed. Mounted with hard_remove, so that the file really is removed
+# rather than hidden by fuse.
+##
+
+. "$(dirname "$0")/../mount.sh"
+
+if ! mount_myfs -o hard_remove; then
+    exit 1
+fi
+
+if ! printf 'first ' > $mnt/open_file; then
+    exit 1
+fi
+
+exec 3>>$mnt/open_file
+exec 4<$mnt/open_file
+
+if ! printf 'second ' >&3; then
+    exit 1
+fi
+
+if [ "$(cat $mnt/open_file)" != "first second " ]; then
+    exit 1
+fi
+
+if ! rm $mnt/open_file; then
+    exit 1
+fi
+
+# The file is gone from the directory, but not from the open descriptors
+if ! printf 'third' >&3; then
+    exit 1
+fi
+
+if ! IFS= read -r -N 18 contents <&4 || [ "$contents" != "first second third" ]; then
+    exit 1
+fi
+
+exec 3>&- 4<&-
+
+if [ -e $mnt/open_file ]; then
+    exit 1
+fi
+
+if ! unmount_myfs; then
+    exit 1
+fi
@@ -0,0 +1,32 @@
+##
+# Tests names of every length, up to the longest a dirent holds (239)
+##
+
+if ! mkdir -p $1/name_lengths; then
+    exit 1
+fi
+
+for i in $(seq 1 239); do
+    if ! touch $1/name_lengths/$(printf "%${i}s" | tr ' ' 'n'); then
+	exit 1
+    fi
+done
+
+for i in $(seq 1 239); do
+    if [ ! -e $1/name_lengths/$(printf "%${i}s" | tr ' ' 'n') ]; then
+	exit 1
+    fi
+done
+
+if [ "$(ls -1 $1/name_lengths | wc -l)" != "239" ]; then
+    exit 1
+fi
+
+# One longer must be refused rather than cut short
+if touch $1/name_lengths/$(printf "%240s" | tr ' ' 'n') 2>/dev/null; then
+    exit 1
+fi
+
+if ! rm -r $1/name_lengths; then
+    exit 1
+fi
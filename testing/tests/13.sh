@@ -0,0 +1,32 @@
+##
+# Tests listing a directory which takes many readdir calls, each carrying on
+# from the offset the last one stopped at, while entries come and go
+##
+
+if ! mkdir -p $1/streamed_directory; then
+    exit 1
+fi
+
+for i in $(seq 1 3000); do
+    if ! touch $1/streamed_directory/entry_with_a_longer_name_$i; then
+	exit 1
+    fi
+done
+
+# Every entry once, no more
+if [ "$(ls -1 $1/streamed_directory | sort | uniq | wc -l)" != "3000" ]; then
+    exit 1
+fi
+
+if [ "$(ls -1 $1/streamed_directory | wc -l)" != "3000" ]; then
+    exit 1
+fi
+
+# rm reads the directory in between removing the entries it has read
+if ! rm -r $1/streamed_directory; then
+    exit 1
+fi
+
+if [ -e $1/streamed_directory ]; then
+    exit 1
+fi
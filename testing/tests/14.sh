@@ -0,0 +1,54 @@
+##
+# Tests each cache replacement policy with a block cache much smaller than
+# the data, so that blocks are evicted, written back and read in again
+##
+
+. "$(dirname "$0")/../mount.sh"
+
+dd if=/dev/urandom of=$store/big bs=4096 count=2048 > /dev/null 2>&1
+dd if=/dev/urandom of=$store/small bs=4096 count=4 > /dev/null 2>&1
+
+for policy in lru 2q arc; do
+
+    if ! mount_myfs -o cache_policy=$policy,cache_size=256K; then
+	exit 1
+    fi
+
+    if ! cp $store/small $mnt/small_$policy || ! cp $store/big $mnt/big_$policy; then
+	exit 1
+    fi
+
+    # The small file is read again after the big one has been through the cache
+    if ! cmp -s $store/small $mnt/small_$policy || ! cmp -s $store/big $mnt/big_$policy || ! cmp -s $store/small $mnt/small_$policy; then
+	exit 1
+    fi
+
+    if ! unmount_myfs; then
+	exit 1
+    fi
+
+    # The counters are written to the log at unmount
+    if ! grep -q "^block cache: policy $policy, .* [1-9][0-9]* evictions" $store/myfs.log; then
+	exit 1
+    fi
+done
+
+# What every policy wrote must still be there with the default one
+if ! mount_myfs; then
+    exit 1
+fi
+
+for policy in lru 2q arc; do
+    if ! cmp -s $store/small $mnt/small_$policy || ! cmp -s $store/big $mnt/big_$policy; then
+	exit 1
+    fi
+done
+
+if ! unmount_myfs; then
+    exit 1
+fi
+
+# An unknown policy is refused
+if mount_myfs -o cache_policy=fifo; then
+    exit 1
+fi
@@ -0,0 +1,61 @@
+##
+# Tests removing files: a big one returns straight away, its blocks being
+# left to the reaper, and one removed while it is still open is reclaimed
+# at the next mount if the file system stops before it is closed
+##
+
+. "$(dirname "$0")/../mount.sh"
+
+if ! mount_myfs -o hard_remove; then
+    exit 1
+fi
+
+if ! dd if=/dev/zero of=$mnt/big_file bs=1M count=64 > /dev/null 2>&1; then
+    exit 1
+fi
+
+start=$(date +%s)
+
+if ! rm $mnt/big_file; then
+    exit 1
+fi
+
+if [ $(($(date +%s) - start)) -gt 2 ]; then
+    exit 1
+fi
+
+if ! dd if=/dev/urandom of=$mnt/open_file bs=1M count=8 > /dev/null 2>&1; then
+    exit 1
+fi
+
+exec 3<$mnt/open_file
+
+if ! rm $mnt/open_file; then
+    exit 1
+fi
+
+# Commits the removal, with the file still open
+if ! dd if=/dev/urandom of=$mnt/kept_file bs=4096 count=4 conv=fsync > /dev/null 2>&1; then
+    exit 1
+fi
+
+cp $mnt/kept_file $store/kept_file
+
+kill_myfs
+exec 3<&-
+
+if ! mount_myfs; then
+    exit 1
+fi
+
+if ! cmp -s $store/kept_file $mnt/kept_file || [ -e $mnt/open_file ] || [ -e $mnt/big_file ]; then
+    exit 1
+fi
+
+if ! unmount_myfs; then
+    exit 1
+fi
+
+if ! grep -q "and 1 unlinked files left to reclaim" $store/out; then
+    exit 1
+fi
@@ -0,0 +1,67 @@
+##
+# Tests group commit. Nothing is committed until an fsync or the commit
+# interval, and then everything so far is, including the size and blocks
+# of a file which is still open. A crash loses what came after.
+##
+
+. "$(dirname "$0")/../mount.sh"
+
+if ! mount_myfs -o commit_interval=3600; then
+    exit 1
+fi
+
+for i in $(seq 1 500); do
+    if ! echo "small file $i" > $mnt/small_$i; then
+	exit 1
+    fi
+done
+
+# Written by a shell builtin, as closing any descriptor of the file would
+# write its fcb back. The subshell keeps it open without starting anything.
+head -c 786432 /dev/urandom | base64 -w 0 > $store/open_file
+mkfifo $store/hold
+
+(
+    data="$(< $store/open_file)"
+    exec > $mnt/open_file
+    printf '%s' "$data"
+    : 2> $store/written
+    read -r < $store/hold
+) &
+
+while [ ! -e $store/written ]; do
+    sleep 0.1
+done
+
+if ! dd if=/dev/urandom of=$mnt/synced_file bs=4096 count=1 conv=fsync > /dev/null 2>&1; then
+    exit 1
+fi
+
+if ! echo "not committed" > $mnt/late_file; then
+    exit 1
+fi
+
+kill_myfs
+echo > $store/hold
+
+if ! mount_myfs; then
+    exit 1
+fi
+
+for i in $(seq 1 500); do
+    if [ "$(cat $mnt/small_$i)" != "small file $i" ]; then
+	exit 1
+    fi
+done
+
+if ! cmp -s $store/open_file $mnt/open_file; then
+    exit 1
+fi
+
+if [ -e $mnt/late_file ]; then
+    exit 1
+fi
+
+if ! unmount_myfs; then
+    exit 1
+fi
@@ -0,0 +1,64 @@
+##
+# Tests the keyed layout, where a block which was never written has no
+# record: holes read back as zeros however often they are read, and cutting
+# a huge sparse file short only deletes the blocks which were written
+##
+
+. "$(dirname "$0")/../mount.sh"
+
+if ! mount_myfs -o layout=keyed; then
+    exit 1
+fi
+
+if ! truncate -s 64M $mnt/holes; then
+    exit 1
+fi
+
+# The second pass finds the holes already known to have no record
+for pass in 1 2; do
+    if ! cmp -s -n 67108864 $mnt/holes /dev/zero; then
+	exit 1
+    fi
+done
+
+dd if=/dev/urandom of=$store/block bs=4096 count=1 > /dev/null 2>&1
+
+if ! truncate -s 1T $mnt/sparse; then
+    exit 1
+fi
+
+for block in 0 10; do
+    if ! dd if=$store/block of=$mnt/sparse bs=4096 seek=$block conv=notrunc > /dev/null 2>&1; then
+	exit 1
+    fi
+done
+
+# Deleting a key for every block up to the old end would take minutes
+if ! timeout 10 truncate -s 20480 $mnt/sparse; then
+    exit 1
+fi
+
+if ! unmount_myfs || ! mount_myfs -o layout=keyed; then
+    exit 1
+fi
+
+if ! truncate -s 1T $mnt/sparse; then
+    exit 1
+fi
+
+# Block 10 was cut off, so it must come back as a hole
+if ! dd if=$mnt/sparse of=$store/read bs=4096 count=1 > /dev/null 2>&1 || ! cmp -s $store/block $store/read; then
+    exit 1
+fi
+
+if ! cmp -s -i 40960 -n 4096 $mnt/sparse /dev/zero; then
+    exit 1
+fi
+
+if ! timeout 10 rm $mnt/sparse || ! rm $mnt/holes; then
+    exit 1
+fi
+
+if ! unmount_myfs; then
+    exit 1
+fi
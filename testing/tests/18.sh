@@ -0,0 +1,67 @@
+##
+# Tests running out of space with the flat layout: myfs can't grow its data
+# file past a limit on the size of the files it writes, so a write beyond it
+# fails with ENOSPC, keeping what went in before, and the space can be used
+# again once the file is removed
+##
+
+. "$(dirname "$0")/../mount.sh"
+
+# Runs myfs with its files limited to 40 MB, failing writes past that
+# rather than killing it
+cat > $store/limited <<LIMITED
+#!/bin/bash
+trap '' XFSZ
+ulimit -f 40960
+exec "$myfs" "\$@"
+LIMITED
+chmod +x $store/limited
+myfs=$store/limited
+
+if ! mount_myfs -o layout=flat; then
+    exit 1
+fi
+
+dd if=/dev/urandom of=$store/data bs=1M count=64 > /dev/null 2>&1
+
+if dd if=$store/data of=$mnt/big_file bs=1M 2> $store/dd; then
+    exit 1
+fi
+
+if ! grep -q "No space left on device" $store/dd; then
+    exit 1
+fi
+
+size=$(stat -c %s $mnt/big_file)
+
+if [ $size -eq 0 ] || [ $size -ge 67108864 ]; then
+    exit 1
+fi
+
+if ! cmp -s -n $size $store/data $mnt/big_file; then
+    exit 1
+fi
+
+if ! rm $mnt/big_file; then
+    exit 1
+fi
+
+# Gives the reaper time to free the blocks, then commits, after which
+# they may be used again. The file synced has no blocks of its own.
+sleep 2
+
+if ! dd if=/dev/null of=$mnt/synced_file conv=fsync > /dev/null 2>&1; then
+    exit 1
+fi
+
+if ! dd if=$store/data of=$mnt/small_file bs=1M count=1 > /dev/null 2>&1; then
+    exit 1
+fi
+
+if ! cmp -s -n 1048576 $store/data $mnt/small_file; then
+    exit 1
+fi
+
+if ! unmount_myfs; then
+    exit 1
+fi
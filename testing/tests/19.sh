@@ -0,0 +1,51 @@
+##
+# Tests the log layout: files written to the log's segments read back the
+# same after a remount, and a log which lost its segments is refused rather
+# than mounted with data missing
+##
+
+. "$(dirname "$0")/../mount.sh"
+
+if ! mount_myfs -o layout=log; then
+    exit 1
+fi
+
+dd if=/dev/urandom of=$store/data bs=1M count=8 > /dev/null 2>&1
+
+for i in $(seq 1 8); do
+    if ! dd if=$store/data of=$mnt/file_$i bs=4096 count=$((i * 256 - 1)) > /dev/null 2>&1; then
+	exit 1
+    fi
+done
+
+if ! unmount_myfs; then
+    exit 1
+fi
+
+if ! grep -q "^log: [1-9][0-9]* segments" $store/myfs.log; then
+    exit 1
+fi
+
+if ! mount_myfs -o layout=log; then
+    exit 1
+fi
+
+for i in $(seq 1 8); do
+    if [ $(stat -c %s $mnt/file_$i) -ne $((i * 1048576 - 4096)) ]; then
+	exit 1
+    fi
+
+    if ! cmp -s -n $((i * 1048576 - 4096)) $store/data $mnt/file_$i; then
+	exit 1
+    fi
+done
+
+if ! unmount_myfs; then
+    exit 1
+fi
+
+truncate -s 0 $store/myfs.db-log
+
+if mount_myfs -o layout=log; then
+    exit 1
+fi
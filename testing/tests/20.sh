@@ -0,0 +1,37 @@
+##
+# Tests reading flat files through a mapping of the data file: what was
+# written reads back the same when mounted with the mmap option, and the
+# blocks are taken from the mapping
+##
+
+. "$(dirname "$0")/../mount.sh"
+
+if ! mount_myfs -o layout=flat; then
+    exit 1
+fi
+
+dd if=/dev/urandom of=$store/data bs=4096 count=1000 > /dev/null 2>&1
+
+if ! cp $store/data $mnt/file; then
+    exit 1
+fi
+
+if ! unmount_myfs; then
+    exit 1
+fi
+
+if ! mount_myfs -o mmap,layout=flat; then
+    exit 1
+fi
+
+if ! cmp -s $store/data $mnt/file; then
+    exit 1
+fi
+
+if ! unmount_myfs; then
+    exit 1
+fi
+
+if ! grep -q "^data map: [1-9][0-9]* blocks read from the mapping" $store/myfs.log; then
+    exit 1
+fi
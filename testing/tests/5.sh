@@ -15,6 +15,11 @@ if ! mkdir -p $1/m/n/o/p/q/r; then
     exit 1
 fi
 
+# A directory which still has entries must not be removed
+if rmdir $1/a/b/c 2>/dev/null; then
+    exit 1
+fi
+
 if ! rm -r $1/a/; then
     exit 1
 fi
@@ -0,0 +1,35 @@
+##
+# Tests a directory large enough to be split over several buckets
+##
+
+if ! mkdir -p $1/large_directory; then
+    exit 1
+fi
+
+for i in $(seq 1 2000); do
+    if ! touch $1/large_directory/entry_$i; then
+	exit 1
+    fi
+done
+
+if [ "$(ls -1 $1/large_directory | wc -l)" != "2000" ]; then
+    exit 1
+fi
+
+for i in $(seq 1 2 2000); do
+    if ! rm $1/large_directory/entry_$i; then
+	exit 1
+    fi
+done
+
+if [ -e $1/large_directory/entry_1 ] || [ ! -e $1/large_directory/entry_2 ]; then
+    exit 1
+fi
+
+if [ "$(ls -1 $1/large_directory | wc -l)" != "1000" ]; then
+    exit 1
+fi
+
+if ! rm -r $1/large_directory; then
+    exit 1
+fi